@@ -17,8 +17,10 @@ if sys.version_info[0] == 2:
 help_short= 'enter h for help'
 help_msg = '''commands 
     s   skip currenly playing song
+    j   jump to position in current song
     m   update stream metadata
     p   set stream source
+    t   print stream statistics
     e   exit demosauce gacefully
     h   print help
     q   quit'''
@@ -50,6 +52,19 @@ def mainloop(fd):
         elif cmd == 's':
             sendorbust(fd, 'SKIP')
 
+        elif cmd == 'j':
+            seconds = prompt('enter position in seconds')
+            try:
+                float(seconds)
+            except ValueError:
+                print('not a number, aborting')
+                continue
+            sendorbust(fd, 'SEEK %s' % seconds)
+
+        elif cmd == 't':
+            sendorbust(fd, 'STAT')
+            print(fd.recv(4096).decode('utf-8'), end='')
+
         elif cmd == 'e':
             confirm = prompt('you are about to make the music stop, confirm by typing "yes"')
             if confirm == 'yes':
@@ -9,20 +9,20 @@ fi
 
 # Debian (and Ubuntu obviously)
 if [ -f /etc/debian_version ] ; then
-	aptitude -y install build-essential libmp3lame-dev libavformat-dev libsamplerate-dev libshout-dev libid3tag0-dev zip
+	aptitude -y install build-essential libmp3lame-dev libavformat-dev libsamplerate-dev libshout-dev zip
 	exit
 fi
 
 # RedHat (and Fedora)
 if [ -f /etc/redhat-release ] ; then
-	yum -y install gcc libsamplerate-devel libshout3-devel libid3tag-devel 
+	yum -y install gcc libsamplerate-devel libshout3-devel
 	exit
 fi
 
 # openSUSE
 if [ -d /etc/YaST2 ] ; then
 	echo "you need to enable the Pacman repository"
-	zypper install gcc make libsamplerate-devel libshout-devel libid3tag-devel
+	zypper install gcc make libsamplerate-devel libshout-devel
 	exit
 fi
 
@@ -35,7 +35,7 @@ fi
 # Gentoo
 # G++ is assumed already installed
 if [ -f /etc/gentoo-release ] ; then
-	emerge -avuDN yasm lame libshout libsamplerate libid3tag 
+	emerge -avuDN yasm lame libshout libsamplerate 
 	exit
 fi
 
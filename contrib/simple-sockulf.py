@@ -10,28 +10,26 @@
 # ----------------------------------------------------------------------------
 
 from __future__ import print_function
-import os, socket, random, pickle, re, sys, signal, subprocess as sp
+import os, socket, random, pickle, json, sys, signal, subprocess as sp
 from optparse import OptionParser
 
-def gv(data, exp):
-    r = re.compile(exp)
-    try:
-        return r.search(data).group(1)
-    except:
-        return ''
-
-def scan(path):
+# scans all paths with one scan process, it prints a json object per file
+def scan(paths):
     program = '../scan'
-    p = sp.Popen([program, path], stdout = sp.PIPE)
-    output = p.communicate()[0]
-    if p.returncode != 0:
-        return (False, '', '', '0')
-    output = output.decode('utf-8', 'ignore')
-    artist = gv(output, r'artist:(.*)')
-    title = gv(output, r'title:(.*)')
-    gain = gv(output, r'replaygain:(-?\d*\.?\d+)')
-    print(path, artist, title, gain, "dB")
-    return (True, title, artist, gain)
+    p = sp.Popen([program, '-i', 'sockulf.idx', '-'], stdin = sp.PIPE, stdout = sp.PIPE)
+    output = p.communicate('\n'.join(paths).encode('utf-8'))[0]
+    results = {}
+    for line in output.decode('utf-8', 'ignore').splitlines():
+        r = json.loads(line)
+        if 'error' in r:
+            results[r['path']] = (False, '', '', '0')
+            continue
+        artist = r.get('artist', '')
+        title = r.get('title', '')
+        gain = str(r.get('replaygain', 0))
+        print(r['path'], artist, title, gain, "dB")
+        results[r['path']] = (True, title, artist, gain)
+    return results
     
 # a very simple database
 class songDb(object):
@@ -45,10 +43,11 @@ class songDb(object):
     def save(self):
         pickle.dump(self.dict, open(self.file, 'wb'), 2)
     
-    def add(self, path):
-        if not path in self.dict:
-            self.dict[path] = scan(path)
-        return self.dict[path][0]
+    def add(self, paths):
+        new = [p for p in paths if not p in self.dict]
+        if new:
+            self.dict.update(scan(new))
+        return [p for p in paths if p in self.dict and self.dict[p][0]]
 
     def get(self, path):
         return self.dict[path]
@@ -71,10 +70,8 @@ class djDerp(object):
         print('scanning files')
         for dir, dirs, files in os.walk(root):
             for f in files:
-                path = os.path.join(dir, f)
-                if self.db.add(path):
-                    pathlist.append(path)
-        return pathlist
+                pathlist.append(os.path.join(dir, f))
+        return self.db.add(pathlist)
 
     # returns filename, title, artist, gain
     def nextsong(self):
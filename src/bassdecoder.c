@@ -8,23 +8,23 @@
 *   copyright MMXIII by maep
 */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
 #include <strings.h>
 #include <limits.h>
-#include <id3tag.h>
+#include <pthread.h>
 #include <bass.h>
 #include "log.h"
 #include "settings.h"
 #include "effects.h"
 #include "bassdecoder.h"
 
-#define IS_MOD(dec)         (bool)((dec)->channel_info.ctype & BASS_CTYPE_MUSIC_MOD)
 #define IS_AMIGAMOD(dec)    (bool)((dec)->channel_info.ctype == BASS_CTYPE_MUSIC_MOD)
 
 struct bassdecoder {
     struct buffer       read_buffer;
+    struct buffer       tags;               // key-value string
     DWORD               channel;
     BASS_CHANNELINFO    channel_info;
     int                 samplerate;
@@ -60,23 +60,25 @@ static void bass_decode(struct decoder* dec, struct stream* s, int frames)
         LOG_DEBUG("[bassdecoder] eos %d frames left", s->frames);
 }
 
-static void bass_seek(struct decoder* dec, long position)
+static void bass_seek(struct decoder* dec, long frame)
 {
-    // TODO implement me!
+    struct bassdecoder* d = dec->handle;
+    frame = CLAMP(0, frame, d->last_frame);
+    QWORD pos = (QWORD)frame * sizeof (float) * d->channel_info.chans;
+    // without prescan byte positions may be refused, then decode from the start up to it
+    if (!BASS_ChannelSetPosition(d->channel, pos, BASS_POS_BYTE)) {
+        if (!BASS_ChannelSetPosition(d->channel, 0, BASS_POS_MUSIC_ORDER) ||
+            !BASS_ChannelSetPosition(d->channel, pos, BASS_POS_BYTE | BASS_POS_DECODETO)) {
+            LOG_WARN("[bassdecoder] seek failed (%d)", BASS_ErrorGetCode());
+            return;
+        }
+    }
+    d->current_frame = frame;
 }
 
 static const char* codec_type(struct bassdecoder* d)
 {
     switch (d->channel_info.ctype) {
-    case BASS_CTYPE_STREAM_OGG: return "vorbis";
-    case BASS_CTYPE_STREAM_MP1:
-    case BASS_CTYPE_STREAM_MP2: return "mp2";
-    case BASS_CTYPE_STREAM_MP3: return "mp3";
-    case BASS_CTYPE_STREAM_AIFF:
-    case BASS_CTYPE_STREAM_WAV_PCM:
-    case BASS_CTYPE_STREAM_WAV_FLOAT:
-    case BASS_CTYPE_STREAM_WAV: return "pcm";
-
     case BASS_CTYPE_MUSIC_MOD:  return "mod";
     case BASS_CTYPE_MUSIC_MTM:  return "mtm";
     case BASS_CTYPE_MUSIC_S3M:  return "s3m";
@@ -94,115 +96,33 @@ static void bass_info(struct decoder* dec, struct info* info)
     info->channels      = d->channel_info.chans;
     info->samplerate    = d->channel_info.freq;
     info->frames        = d->last_frame;
-    info->flags         = INFO_BASS;
+    info->flags         = INFO_BASS | INFO_SEEKABLE | INFO_MOD;
     info->codec         = codec_type(d); 
-    if (IS_MOD(d)) 
-        info->flags |= INFO_MOD;
     if (IS_AMIGAMOD(d))
         info->flags |= INFO_AMIGAMOD;
-    if (!IS_MOD(d)) {
-        float size = BASS_StreamGetFilePosition(d->channel, BASS_FILEPOS_END);
-        float duration = (float)d->last_frame / d->channel_info.freq;
-        info->bitrate = size / (125 * duration);
-    }
 }
 
-static char* get_id3_tag(const TAG_ID3* tags, const char* key)
+// modules only have a title
+static void read_tags(struct bassdecoder* d)
 {
-    char* value = NULL;
-    if (!strcmp(key, "artist")) {
-        value = calloc(31, 1);
-        memmove(value, tags->artist, 30);
-    } else if (!strcmp(key, "title")) {
-        value = calloc(31, 1);
-        memmove(value, tags->title, 30);
-    }
-    return value;
-}
-
-// and the award to the bestesd documented lib goes to libid3tag! the closest
-// thing i could find to a documentation was a mailing list entry from 2002
-// http://www.mars.org/pipermail/mad-dev/2002-January/000439.html
-static char* get_id3v2_tag(const id3_byte_t* tags, const char* key)
-{
-    const char* frame_id = NULL;
-    id3_utf8_t* utf_str = NULL;
-    if (!strcmp(key, "artist")) 
-        frame_id = ID3_FRAME_ARTIST;
-    else if (!strcmp(key, "title"))
-        frame_id = ID3_FRAME_TITLE;
-    else
-        goto id3_quit;
-
-    long length = id3_tag_query(tags, ID3_TAG_QUERYSIZE);
-    if (!length) 
-        goto id3_quit;
-
-    struct id3_tag* tag = id3_tag_parse(tags, length);
-    if (!tag)
-        goto id3_quit;
-
-    struct id3_frame* frame = id3_tag_findframe(tag, frame_id, 0);
-    if (!frame) 
-        goto id3_quit_tag;
-
-    union id3_field* field = id3_frame_field(frame, 1);
-    const id3_ucs4_t* ucs_str = id3_field_getstrings(field, 0);
-    if (!ucs_str)
-        goto id3_quit_frame;
-
-    utf_str = id3_ucs4_utf8duplicate(ucs_str);
-    // TODO free ucs string?
-
-id3_quit_frame:
-    id3_frame_delete(frame);
-id3_quit_tag:
-    id3_tag_delete(tag);
-id3_quit:
-    return (char*)utf_str;
-}
-
-static char* get_ogg_tag(const char* tags, const char* key)
-{
-    return keyval_str_dup(tags, key, NULL);
-}
-
-static char* get_tag(DWORD channel, const char* key)
-{
-    const void* tags = NULL;
-    tags = BASS_ChannelGetTags(channel, BASS_TAG_ID3V2);
-    if (tags) 
-        return get_id3v2_tag(tags, key);
-    tags = BASS_ChannelGetTags(channel, BASS_TAG_ID3);
-    if (tags)
-        return get_id3_tag(tags, key);
-    tags = BASS_ChannelGetTags(channel, BASS_TAG_OGG);
-    if (tags)
-        return get_ogg_tag(tags, key);
-    tags = BASS_ChannelGetTags(channel, BASS_TAG_APE);
-    if (tags)
-        return get_ogg_tag(tags, key);
-    tags = BASS_ChannelGetTags(channel, BASS_TAG_MUSIC_NAME);
-    if (tags && !strcmp(key, "title"))
-        return util_strdup(tags);
-    return NULL;
+    const char* title = BASS_ChannelGetTags(d->channel, BASS_TAG_MUSIC_NAME);
+    if (title)
+        keyval_append(&d->tags, "title", title, -1);
 }
 
 static char* bass_metadata(struct decoder* dec, const char* key)
 {
     struct bassdecoder* d = dec->handle;
-    return util_trim(get_tag(d->channel, key));
+    return keyval_str_dup(d->tags.data, key, NULL);
 }
 
 static void bass_free(struct decoder* dec)
 {
     struct bassdecoder* d = dec->handle;
     buffer_free(&d->read_buffer);
+    buffer_free(&d->tags);
     if (d->channel) {
-        if (IS_MOD(d)) 
-            BASS_MusicFree(d->channel);
-        else 
-            BASS_StreamFree(d->channel);
+        BASS_MusicFree(d->channel);
         if (BASS_ErrorGetCode() != BASS_OK)
              LOG_WARN("[bassdecoder] failed to free channel (%d)", BASS_ErrorGetCode());
     }
@@ -219,27 +139,29 @@ void bass_set_loop_duration(struct decoder* dec, double duration)
 
 bool bass_load(struct decoder* dec, const char* path, const char* options, int samplerate)
 {
+    // scan loads files from several threads, BASS_Init must only happen once
+    static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
     static bool initialized = false;
+    pthread_mutex_lock(&init_lock);
     if (!initialized) {
         BASS_SetConfig(BASS_CONFIG_UPDATEPERIOD, 0);
-        if (!BASS_Init(0, samplerate, 0, 0, NULL)) {
-            LOG_ERROR("[bassdecoder] BASS_Init failed");
-            return false; 
-        }
-        initialized = true;
+        initialized = BASS_Init(0, samplerate, 0, 0, NULL);
+    }
+    pthread_mutex_unlock(&init_lock);
+    if (!initialized) {
+        LOG_ERROR("[bassdecoder] BASS_Init failed");
+        return false; 
     }
 
     LOG_DEBUG("[bassdecoder] loading %s", path);
 
-    // always prescan music or it may loop forever, BASS_MUSIC_STOPBACK would fix that
-    // but might also break some mods from playing correctly
-    bool prescan = keyval_bool(options, "bass_prescan", false);    
-    DWORD stream_flags = BASS_STREAM_DECODE | (prescan ? BASS_STREAM_PRESCAN : 0) | BASS_SAMPLE_FLOAT;
-    DWORD music_flags = BASS_MUSIC_DECODE | BASS_MUSIC_PRESCAN | BASS_MUSIC_FLOAT;
+    // music is prescanned to get its length, and so it can't loop forever. BASS_MUSIC_STOPBACK 
+    // would fix that too, but might also break some mods from playing correctly. the prescan
+    // renders the whole module, so with a duration from scan last_frame ends it instead
+    double duration = keyval_real(options, "duration", 0);
+    DWORD music_flags = BASS_MUSIC_DECODE | (duration > 0 ? 0 : BASS_MUSIC_PRESCAN) | BASS_MUSIC_FLOAT;
 
-    DWORD channel = BASS_StreamCreateFile(FALSE, path, 0, 0, stream_flags);
-    if (!channel) 
-        channel = BASS_MusicLoad(FALSE, path, 0, 0 , music_flags, samplerate);
+    DWORD channel = BASS_MusicLoad(FALSE, path, 0, 0 , music_flags, samplerate);
     if (!channel) {
         LOG_DEBUG("[bassdecoder] failed to load %s", path);
         return false;
@@ -251,32 +173,36 @@ bool bass_load(struct decoder* dec, const char* path, const char* options, int s
     BASS_ChannelGetInfo(channel, &d->channel_info);
     long len_bytes = (long)BASS_ChannelGetLength(channel, BASS_POS_BYTE);
     d->last_frame = (len_bytes < 0) ? LONG_MAX : len_bytes / (sizeof (float) * d->channel_info.chans);
+    if (duration > 0) {
+        d->last_frame = duration * d->channel_info.freq;
+        LOG_DEBUG("[bassdecoder] skipped prescan, length %f seconds", duration);
+    }
 
-    if (IS_MOD(d)) {
-        // interpolation, values: auto, auto, off, linear, sinc (bass uses linear as default)
-        char inter_str[8] = {0};
-        keyval_str(inter_str, 8, options, "bass_inter", "auto");
-        if ((IS_AMIGAMOD(d) && !strcmp(inter_str, "auto")) || !strcmp(inter_str, "off")) 
-            BASS_ChannelFlags(channel, BASS_MUSIC_NONINTER, BASS_MUSIC_NONINTER);
-        else if (!strcmp(inter_str, "sinc"))
-            BASS_ChannelFlags(channel, BASS_MUSIC_SINCINTER, BASS_MUSIC_SINCINTER);
-
-        // ramping, values: auto, normal, sensitive
-        char ramp_str[12] = {0};
-        keyval_str(ramp_str, 12, options, "bass_ramp", "auto");
-        if ((!IS_AMIGAMOD(d) && !strcmp(ramp_str, "auto")) || !strcmp(inter_str, "normal"))
-            BASS_ChannelFlags(channel, BASS_MUSIC_RAMP, BASS_MUSIC_RAMP);
-        else if (!strcmp(ramp_str, "sensitive"))
-            BASS_ChannelFlags(channel, BASS_MUSIC_RAMPS, BASS_MUSIC_RAMPS);
-
-        // playback mode, values: auto, bass, pt1, ft2 (bass is default)
-        char mode_str[8] = {0};
-        keyval_str(mode_str, 8, options, "bass_mode", "auto");
-        if ((IS_AMIGAMOD(d) && !strcmp(mode_str, "auto")) || !strcmp(mode_str, "pt1"))
-            BASS_ChannelFlags(channel, BASS_MUSIC_PT1MOD, BASS_MUSIC_PT1MOD);
-        else if (!strcmp(mode_str, "ft2"))
-            BASS_ChannelFlags(channel, BASS_MUSIC_FT2MOD, BASS_MUSIC_FT2MOD);
-    } 
+    // interpolation, values: auto, auto, off, linear, sinc (bass uses linear as default)
+    char inter_str[8] = {0};
+    keyval_str(inter_str, 8, options, "bass_inter", "auto");
+    if ((IS_AMIGAMOD(d) && !strcmp(inter_str, "auto")) || !strcmp(inter_str, "off")) 
+        BASS_ChannelFlags(channel, BASS_MUSIC_NONINTER, BASS_MUSIC_NONINTER);
+    else if (!strcmp(inter_str, "sinc"))
+        BASS_ChannelFlags(channel, BASS_MUSIC_SINCINTER, BASS_MUSIC_SINCINTER);
+
+    // ramping, values: auto, normal, sensitive
+    char ramp_str[12] = {0};
+    keyval_str(ramp_str, 12, options, "bass_ramp", "auto");
+    if ((!IS_AMIGAMOD(d) && !strcmp(ramp_str, "auto")) || !strcmp(ramp_str, "normal"))
+        BASS_ChannelFlags(channel, BASS_MUSIC_RAMP, BASS_MUSIC_RAMP);
+    else if (!strcmp(ramp_str, "sensitive"))
+        BASS_ChannelFlags(channel, BASS_MUSIC_RAMPS, BASS_MUSIC_RAMPS);
+
+    // playback mode, values: auto, bass, pt1, ft2 (bass is default)
+    char mode_str[8] = {0};
+    keyval_str(mode_str, 8, options, "bass_mode", "auto");
+    if ((IS_AMIGAMOD(d) && !strcmp(mode_str, "auto")) || !strcmp(mode_str, "pt1"))
+        BASS_ChannelFlags(channel, BASS_MUSIC_PT1MOD, BASS_MUSIC_PT1MOD);
+    else if (!strcmp(mode_str, "ft2"))
+        BASS_ChannelFlags(channel, BASS_MUSIC_FT2MOD, BASS_MUSIC_FT2MOD);
+
+    read_tags(d);
 
     dec->free       = bass_free;
     dec->seek       = bass_seek;
@@ -289,60 +215,21 @@ bool bass_load(struct decoder* dec, const char* path, const char* options, int s
     return true;
 }
 
-float bass_loopiness(const char* path)
-{
-    // what I'm doing here is find the last 50 ms of a track and return the average positive value
-    // i got a bit lazy here, but this part isn't so crucial anyways
-    // flags to make decoding as fast as possible. still use 44100 hz, because lower setting might
-    // remove upper frequencies that could indicate a loop
-    float loopiness     = 0;
-    int flags           = BASS_MUSIC_DECODE | BASS_SAMPLE_MONO | BASS_MUSIC_NONINTER | BASS_MUSIC_PRESCAN;
-    int samplerate      = 44100;
-    int check_frames    = samplerate / 20;
-    int check_bytes     = check_frames * sizeof (int16_t);
-    int16_t* buf        = NULL;
-
-    HMUSIC channel = BASS_MusicLoad(FALSE, path, 0, 0 , flags, samplerate);
-
-    BASS_CHANNELINFO channel_info = {0};
-    BASS_ChannelGetInfo(channel, &channel_info);
-    if (!(channel_info.ctype & BASS_CTYPE_MUSIC_MOD))
-        goto error;
-
-    QWORD length = BASS_ChannelGetLength(channel, BASS_POS_BYTE);
-    if (!BASS_ChannelSetPosition(channel, length - check_bytes, BASS_POS_BYTE)) 
-        goto error;
-
-    buf = calloc(check_bytes, 1);
-    for (int i = 0; i < check_bytes && BASS_ErrorGetCode() == BASS_OK;) {
-        DWORD r = BASS_ChannelGetData(channel, (char*)buf + i, check_bytes - i);
-        i += r;
-    }
-
-    long accu = 0;
-    for (int i = 0; i < check_frames; i++) 
-        accu += fabs(buf[i]);
-    loopiness = (float)accu / check_frames / -INT16_MIN;
-
-error:
-    BASS_MusicFree(channel);
-    free(buf);
-    return loopiness;
-}
-
 bool bass_probe(const char* path)
 {
-    const char* ext[] = {".mp3", ".mp2", ".wav", ".aiff", ".xm", ".mod", ".s3m", ".it", ".mtm", ".umx", ".mo3", ".fst"};
+    const char* ext[] = {".xm", ".mod", ".s3m", ".it", ".mtm", ".umx", ".mo3", ".fst"};
+    const char* tmp = strrchr(path, '.');
     for (int i = 0; i < COUNT(ext); i++) {
-        const char* tmp = strrchr(path, '.');
         if (tmp && !strcasecmp(tmp, ext[i])) 
             return true;
     }
 
     // extrawurst for AMP :)
+    const char* name = strrchr(path, '/');
+    name = name ? name + 1 : path;
     const char* ext2[] = {"xm.", "mod.", "s3m.", "it.", "mtm.", "umx.", "mo3.", "fst."};
     for (int i = 0; i < COUNT(ext2); i++) {
-        if (!strncasecmp(path, ext2[i], strlen(ext2[i])))
+        if (!strncasecmp(name, ext2[i], strlen(ext2[i])))
             return true;
     }
 
@@ -14,10 +14,11 @@
 #include "util.h"
 
 bool    bass_loadso(void); 
+// true if <path> has the extension of a module format
 bool    bass_probe(const char* path);
+// loads a module, other formats are left to ffmpeg
 bool    bass_load(struct decoder* dec, const char* path, const char* options, int samplerate);
 void    bass_set_loop_duration(struct decoder* dec, double duration);
-float   bass_loopiness(const char* path);
 
 #endif
 
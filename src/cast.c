@@ -8,6 +8,7 @@
 *   copyright MMXIII by maep
 */
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
@@ -19,64 +20,115 @@
 #include "settings.h"
 #include "effects.h"
 #include "ffdecoder.h"
+#include "probe.h"
 #ifdef ENABLE_BASS
     #include "bassdecoder.h"
 #endif
+#ifdef ENABLE_OPENMPT
+    #include "openmptdecoder.h"
+#endif
 #include "cast.h"
 
 #define RETRY_TIME      15      // seconds to wait before retry
+#define MIN_BACKOFF     250     // miliseconds to wait before first icecast reconnect
 #define SILENCE_TIME    60      // seconds to play silence after LOAD_TRIES failed
 #define BUFFER_SIZE     200     // miliseconds
 #define FADE_TIME       5       // seconds
 #define MIX_RATIO       0.4     // default mix ratio for amiga modules
 #define LOAD_TRIES      3
+#define QUEUE_POLL      5       // miliseconds to wait when a queue is full or empty
+#define CONNECT_TIMEOUT 10      // seconds to wait for icecast to accept connection
+#define STALL_TIME      1000    // miliseconds of network backlog until output counts as stalled
+#define STAT_INTERVAL   300     // seconds between logging output statistics
+#define WARMUP_TIME     5       // seconds into a track after which decoding must not allocate
 
-static const char* remote_cmd[] = {NULL, "SKIP", "PLAY", "META", "QUIT"};
+static const char* remote_cmd[] = {NULL, "SKIP", "PLAY", "META", "QUIT", "STAT", "SEEK"};
 
 enum remote_commands {
     COMMAND_NOP  = 0,
     COMMAND_SKIP,
     COMMAND_PLAY,
     COMMAND_META,
-    COMMAND_QUIT
+    COMMAND_QUIT,
+    COMMAND_STAT,
+    COMMAND_SEEK
 };                        
 
-static lame_t           lame;
-static shout_t*         shout;
-static struct stream    stream0;
-static struct stream    stream1;
+enum next_states {
+    NEXT_IDLE = 0,                              // no next track, loader not running
+    NEXT_LOADING,                               // loader thread is preparing next track
+    NEXT_READY                                  // next track can be played
+};
+
+struct track {
+    struct decoder  decoder;
+    struct info     info;
+    struct buffer   config;                     // key-value set from NEXTSONG
+    struct stream   stream;                     // decoder output, when resampling
+    struct fx_chain fx;
+    void*           resampler;
+    long            played_frames;              // at encoder samplerate, counted from start of file
+    long            remaining_frames;           // forced play length left
+    bool            primed;                     // first block already decoded into stream
+};
+
+struct mp3_block {
+    struct buffer   data;
+    long            duration;                   // miliseconds
+};
+
+// one encoder and icecast connection per profile, all fed by the same decoder
+struct output {
+    struct profile* profile;
+    lame_t          lame;
+    shout_t*        shout;
+    struct queue    pcm_queue;                  // struct stream, decoder -> encoder
+    struct queue    mp3_queue;                  // struct mp3_block, encoder -> sender
+    pthread_t       encoder;
+    pthread_t       sender;
+    int             connected;
+    int             meta_pending;               // cast_title changed, sender applies it
+    int             stalled;                    // sender can't get rid of data
+    long            high_water;                 // maximum mp3_queue fill, in blocks
+    long            drops;                      // blocks dropped while stalled
+};
+
+static struct output    outputs[MAX_PROFILES];
+static int              output_count;
+static pthread_mutex_t  meta_lock = PTHREAD_MUTEX_INITIALIZER; // cast_title
+static char             cast_title[1024];       // current metadata
+static struct stream    block;                  // decoder output, copied to all outputs
+static struct stream    tail;                   // start of next track in a block
 static struct buffer    remote_buf;
-static struct buffer    config_buf;
-static struct buffer    lame_buf;
-static struct info      info;
-static struct decoder   decoder;
-static struct fx_fade   fader;
-static struct fx_mix    mixer;
-static void*            resampler;             
-static float            gain;
-static long             remaining_frames;
-static bool             mixer_enabled;
-static bool             fader_enabled;
+static struct buffer    play_buf;               // song set by PLAY command
+static struct track     tracks[2];
+static struct track*    current = &tracks[0];
+static struct track*    next    = &tracks[1];
+static pthread_t        loader;
 static bool             have_remote;
-static sig_atomic_t     decoder_ready;
+static bool             quit;
 static sig_atomic_t     remote_command;
+static int              next_state;
+static int              running;                // pipeline threads run while set
 
-static void get_next_song(void)
+static void get_next_song(struct buffer* config)
 {
     if (have_remote) {
-        have_remote = false; // config_buf already contains info
+        have_remote = false;
+        buffer_resize(config, play_buf.size);
+        memmove(config->data, play_buf.data, play_buf.size);
     } else if (settings_debug_song) {
-        buffer_resize(&config_buf, strlen(settings_debug_song) + 1);
-        strcpy(config_buf.data, settings_debug_song);
+        buffer_resize(config, strlen(settings_debug_song) + 1);
+        strcpy(config->data, settings_debug_song);
     } else {
-        buffer_zero(&config_buf);
+        buffer_zero(config);
         int socket = socket_connect(settings_demovibes_host, settings_demovibes_port);
         if (socket < 0) {
             LOG_ERROR("[cast] can't connect to demosauce");
             return;
         }
         socket_write(socket, "NEXTSONG", 8);
-        socket_read(socket, &config_buf);
+        socket_read(socket, config);
         socket_close(socket);
     }
 }
@@ -89,53 +141,108 @@ static void zero_generator(struct decoder* dec, struct stream* s, int frames)
     stream_zero(s, 0, frames);
 }
 
-static void configure_effects(const char* config, float forced_length)
+// <forced_length> is the play time in seconds after <cue_in>, 0 plays to the end
+static void configure_effects(struct track* t, float forced_length, float cue_in)
 {
+    const char* config = t->config.data;
+    struct info* info = &t->info;
+
     // play length
-    remaining_frames = LONG_MAX;
+    t->played_frames = cue_in * settings_encoder_samplerate;
+    t->remaining_frames = LONG_MAX;
     if (forced_length > 0) {
-        remaining_frames = settings_encoder_samplerate * forced_length;
+        t->remaining_frames = settings_encoder_samplerate * forced_length;
         LOG_DEBUG("[cast] song length forced to %f seconds", forced_length);
     }
 
     // resampler
-    fx_resample_free(resampler);
-    resampler = NULL;
-    if (info.samplerate != settings_encoder_samplerate) {
-        resampler = fx_resample_init(info.channels, info.samplerate, settings_encoder_samplerate);
-        LOG_DEBUG("[cast] resampling from %d to %d Hz", info.samplerate, settings_encoder_samplerate);
+    fx_resample_free(t->resampler);
+    t->resampler = NULL;
+    if (info->samplerate != settings_encoder_samplerate) {
+        t->resampler = fx_resample_init(info->channels, info->samplerate, settings_encoder_samplerate);
+        LOG_DEBUG("[cast] resampling from %d to %d Hz", info->samplerate, settings_encoder_samplerate);
     }
 
+    // gain
+    float gain = keyval_real(config, "gain", 0.0);
+    LOG_DEBUG("[cast] setting gain to %f dB", gain);
+    fx_chain_init(&t->fx, settings_encoder_channels, db_to_amp(gain), FX_CLIP);
+
     // channel mixing
     char mix_str[8] = {0};
     keyval_str(mix_str, 8, config, "mix", "auto");
-    mixer_enabled = (settings_encoder_channels == 2) && (strcmp(mix_str, "auto") || (info.flags & INFO_AMIGAMOD));
-    if (mixer_enabled) {
+    if ((settings_encoder_channels == 2) && (strcmp(mix_str, "auto") || (info->flags & INFO_AMIGAMOD))) {
         float ratio = keyval_real(config, "mix", MIX_RATIO);
         ratio = CLAMP(0, ratio, 1);
-        fx_mix_init(&mixer, 1.0 - ratio, ratio, 1.0 - ratio, ratio);
+        t->fx.flags |= FX_MIX;
+        fx_mix_init(&t->fx.mix, 1.0 - ratio, ratio, 1.0 - ratio, ratio);
         LOG_DEBUG("[cast] mixing channels with %f ratio", ratio);
     }
 
-    // gain
-    gain = keyval_real(config, "gain", 0.0);
-    LOG_DEBUG("[cast] setting gain to %f dB", gain);
-    gain = db_to_amp(gain);
-
     // fade out
-    fader_enabled = keyval_bool(config, "fade_out", false); 
-    if (fader_enabled) {
-        float length = forced_length > 0 ? forced_length : (info.frames / info.samplerate);
+    if (keyval_bool(config, "fade_out", false)) {
+        float length = forced_length > 0 ? cue_in + forced_length : (info->frames / info->samplerate);
         long start = MAX(0, (length - FADE_TIME)) * settings_encoder_samplerate;
         long end = length * settings_encoder_samplerate;
-        fx_fade_init(&fader, start, end, 1, 0);
+        t->fx.flags |= FX_FADE;
+        fx_fade_init(&t->fx.fade, start, end, 1, 0);
+        t->fx.fade.current_frame = t->played_frames;
         LOG_DEBUG("[cast] fading out at %f seconds", length);
     }
 }
 
+static bool track_loaded(struct track* t)
+{
+    return t->decoder.decode != NULL;
+}
+
+// jumps to <seconds> in the file, the play length and fade out move along
+static void seek_track(struct track* t, float seconds)
+{
+    if (!(t->info.flags & INFO_SEEKABLE)) {
+        LOG_WARN("[cast] can't seek in this track");
+        return;
+    }
+    seconds = MAX(0, seconds);
+    long played = seconds * settings_encoder_samplerate;
+    if (t->remaining_frames != LONG_MAX)
+        t->remaining_frames = MAX(0, t->remaining_frames - (played - t->played_frames));
+    t->played_frames = played;
+    t->fx.fade.current_frame = played;
+    t->decoder.seek(&t->decoder, seconds * t->info.samplerate);
+    // a block decoded ahead is from the old position
+    t->primed = false;
+    t->stream.frames = 0;
+    fx_resample_reset(t->resampler);
+    LOG_DEBUG("[cast] seek to %f seconds", seconds);
+}
+
+static void track_free(struct track* t)
+{
+    if (t->decoder.free)
+        t->decoder.free(&t->decoder);
+    fx_resample_free(t->resampler);
+    buffer_free(&t->config);
+    stream_free(&t->stream);
+    memset(t, 0, sizeof *t);
+}
+
+// libshout isn't thread-safe, only the sender thread of <o> may call this
+static void send_metadata(struct output* o)
+{
+    shout_metadata_t* metadata = shout_metadata_new();
+    pthread_mutex_lock(&meta_lock);
+    ATOMIC_STORE(&o->meta_pending, false);
+    shout_metadata_add(metadata, "song", cast_title);
+    pthread_mutex_unlock(&meta_lock);
+    if (shout_set_metadata(o->shout, metadata) != SHOUTERR_SUCCESS)
+        LOG_WARN("[cast] metadat update failed (%s)", shout_get_error(o->shout));
+    shout_metadata_free(metadata);
+}
+
 static void update_metadata(const char* config)
 {
-    char cast_title[1024]   = {0};
+    char new_title[1024]    = {0};
     char artist[512]        = {0};
     char title[512]         = {0};
 
@@ -144,23 +251,31 @@ static void update_metadata(const char* config)
 
     // remove '-' in artist name, players use it for artist-title separation
     for (size_t i = 0; i < strlen(artist); i++)
-        if (cast_title[i] == '-')
-            cast_title[i] = ' ';
+        if (artist[i] == '-')
+            artist[i] = ' ';
 
     size_t len = strlen(artist);
     if (len > 0) {
-        strcpy(cast_title, artist);
-        strcpy(cast_title + len, " - ");
+        strcpy(new_title, artist);
+        strcpy(new_title + len, " - ");
         len += 3;
     }
-    strcpy(cast_title + len, title);
-    LOG_DEBUG("[cast] updating metadata to '%s'", cast_title);
+    strcpy(new_title + len, title);
+    LOG_DEBUG("[cast] updating metadata to '%s'", new_title);
+
+    // the sender threads pick it up between sends, disconnected ones once they're back
+    pthread_mutex_lock(&meta_lock);
+    strcpy(cast_title, new_title);
+    for (int i = 0; i < output_count; i++)
+        ATOMIC_STORE(&outputs[i].meta_pending, true);
+    pthread_mutex_unlock(&meta_lock);
+}
 
-    shout_metadata_t* metadata = shout_metadata_new();
-    shout_metadata_add(metadata, "song", cast_title);
-    if (shout_set_metadata(shout, metadata) != SHOUTERR_SUCCESS)
-        LOG_WARN("[cast] metadat update failed (%s)", shout_get_error(shout));
-    shout_metadata_free(metadata);
+static int print_stats(char* str, int size, struct output* o)
+{
+    return snprintf(str, size, "mount=%s fill_ms=%ld high_water_ms=%ld drops=%ld stalled=%s\n", 
+        o->profile->mount, queue_fill(&o->mp3_queue) * BUFFER_SIZE, ATOMIC_LOAD(&o->high_water) * BUFFER_SIZE,
+        ATOMIC_LOAD(&o->drops), BOOL_STR(ATOMIC_LOAD(&o->stalled)));
 }
 
 static void remote_handler(void)
@@ -170,21 +285,36 @@ static void remote_handler(void)
     case COMMAND_NOP:
         break;
     case COMMAND_SKIP:
-        remaining_frames = FADE_TIME * settings_encoder_samplerate;
-        fader_enabled = true;
-        fx_fade_init(&fader, 0, remaining_frames, 1, 0);
+        current->remaining_frames = FADE_TIME * settings_encoder_samplerate;
+        current->fx.flags |= FX_FADE;
+        fx_fade_init(&current->fx.fade, 0, current->remaining_frames, 1, 0);
         break;
     case COMMAND_PLAY:
-        buffer_resize(&config_buf, remote_buf.size);
-        memmove(config_buf.data, remote_buf.data, remote_buf.size + 1);
-        config_buf.size = strlen(config_buf.data) + 1;
+        // the loader reads play_buf, keep command pending until it's done
+        if (ATOMIC_LOAD(&next_state) == NEXT_LOADING)
+            return;
+        buffer_resize(&play_buf, remote_buf.size + 1);
+        memmove(play_buf.data, remote_buf.data, remote_buf.size + 1);
+        play_buf.size = strlen(play_buf.data) + 1;
         have_remote = true;
+        // a preloaded track is replaced by the requested one
+        if (ATOMIC_LOAD(&next_state) == NEXT_READY) {
+            pthread_join(loader, NULL);
+            track_free(next);
+            ATOMIC_STORE(&next_state, NEXT_IDLE);
+        }
         break;
     case COMMAND_META:
         update_metadata(remote_buf.data);
         break;
+    case COMMAND_SEEK:
+        if (track_loaded(current))
+            seek_track(current, atof(remote_buf.data));
+        break;
     case COMMAND_QUIT:
-        exit(EXIT_SUCCESS);
+        quit = true;
+        ATOMIC_STORE(&running, false);
+        break;
     }
     remote_command = COMMAND_NOP;
 }
@@ -213,6 +343,18 @@ static void* remote_control(void* data)
                 LOG_DEBUG("[remote] got command '%s'", cmd);
             else
                 LOG_WARN("[remote] unknown command");
+
+            // statistics are answered right here, the decoder isn't involved
+            if (remote_command == COMMAND_STAT) {
+                char stats[512 * MAX_PROFILES] = {0};
+                int len = 0;
+                for (int i = 0; i < output_count && len < sizeof stats; i++)
+                    len += print_stats(stats + len, sizeof stats - len, outputs + i);
+                if (len < sizeof stats)
+                    util_mem_print(stats + len, sizeof stats - len);
+                socket_write(socket, stats, strlen(stats));
+                remote_command = COMMAND_NOP;
+            }
         }
         LOG_DEBUG("[remote] disconnected");
         socket_close(socket);
@@ -221,26 +363,23 @@ static void* remote_control(void* data)
     return NULL;
 }
 
+// loader thread, prepares next track while current one is still playing
 static void* load_next(void* data)
 {
-    char    path[4096]      = {0};
-    float   forced_length   = 0;
-    int     tries           = 0;
-    bool    loaded          = false;
-
-    if (decoder.free)
-        decoder.free(&decoder);
-    memset(&decoder, 0, sizeof(struct decoder));
-    memset(&info, 0, sizeof(struct info));
+    struct track*   t               = next;
+    char            path[4096]      = {0};
+    float           forced_length   = 0;
+    float           cue_in          = 0;
+    int             tries           = 0;
+    bool            loaded          = false;
+    
+    long            start           = 0;
     
     while (tries++ < LOAD_TRIES && !loaded) {
-        get_next_song();
-        keyval_str(path, sizeof(path), config_buf.data, "path", "");
-#ifdef ENABLE_BASS
-        loaded = bass_load(&decoder, path, config_buf.data, settings_encoder_samplerate);
-#endif
-        if (!loaded)
-            loaded = ff_load(&decoder, path);
+        start = util_time_ms();
+        get_next_song(&t->config);
+        keyval_str(path, sizeof(path), t->config.data, "path", "");
+        loaded = probe_load(&t->decoder, path, t->config.data, settings_encoder_samplerate);
         if (!loaded) {
             LOG_ERROR("[cast] failed to load '%s'", path);
             sleep(3);
@@ -248,85 +387,220 @@ static void* load_next(void* data)
     }
 
     if (loaded) {
-        decoder.info(&decoder, &info);
-        if (info.frames <= 0)
+        t->decoder.info(&t->decoder, &t->info);
+        if (t->info.frames <= 0)
             LOG_WARN("[cast] no length '%s'", path);
-        forced_length = keyval_real(config_buf.data, "length", 0);
+        forced_length = keyval_real(t->config.data, "length", 0);
+        // cue points in seconds, the intro before cue_in is skipped without decoding it
+        cue_in = keyval_real(t->config.data, "cue_in", 0);
+        float cue_out = keyval_real(t->config.data, "cue_out", 0);
+        if (cue_in > 0 && !(t->info.flags & INFO_SEEKABLE)) {
+            LOG_WARN("[cast] can't cue '%s'", path);
+            cue_in = 0;
+        }
+        if (cue_out > cue_in)
+            forced_length = forced_length > 0 ? MIN(forced_length, cue_out - cue_in) : cue_out - cue_in;
+#if defined(ENABLE_BASS) || defined(ENABLE_OPENMPT)
+        // module loops are played until the end position
+        float end = forced_length > 0 ? cue_in + forced_length : 0;
+#endif
 #ifdef ENABLE_BASS
-        if ((info.flags & INFO_BASS) && forced_length > info.frames / info.samplerate) 
-            bass_set_loop_duration(&decoder, forced_length);
+        if ((t->info.flags & INFO_BASS) && end > t->info.frames / t->info.samplerate) 
+            bass_set_loop_duration(&t->decoder, end);
 #endif
+#ifdef ENABLE_OPENMPT
+        if ((t->info.flags & INFO_OPENMPT) && end > t->info.frames / t->info.samplerate)
+            openmpt_set_loop_duration(&t->decoder, end);
+#endif
+        if (cue_in > 0)
+            t->decoder.seek(&t->decoder, cue_in * t->info.samplerate);
     } else {
         LOG_WARN("[cast] load failed three times, sending one minute sound of silence");
-        decoder.decode  = zero_generator;
-        info.samplerate = settings_encoder_samplerate;
-        info.channels   = settings_encoder_channels;
-        forced_length   = SILENCE_TIME;
-        buffer_zero(&config_buf);
+        memset(&t->decoder, 0, sizeof t->decoder);
+        t->decoder.decode   = zero_generator;
+        t->info.samplerate  = settings_encoder_samplerate;
+        t->info.channels    = settings_encoder_channels;
+        forced_length       = SILENCE_TIME;
+        buffer_zero(&t->config);
     }
 
-    configure_effects(config_buf.data, forced_length);
-    update_metadata(config_buf.data);
-    decoder_ready = true;
+    configure_effects(t, forced_length, cue_in);
+
+    // decode first block now, so a slow start doesn't stall the track change
+    int frames = (t->info.samplerate * BUFFER_SIZE) / 1000;
+    t->decoder.decode(&t->decoder, &t->stream, frames);
+    t->primed = true;
+    if (loaded)
+        LOG_INFO("[cast] first block of '%s' %ld ms after NEXTSONG", path, util_time_ms() - start);
+
+    ATOMIC_STORE(&next_state, NEXT_READY);
     return NULL;
 }
 
+static void start_loader(void)
+{
+    if (ATOMIC_LOAD(&next_state) != NEXT_IDLE)
+        return;
+    LOG_DEBUG("[cast] preloading next track");
+    ATOMIC_STORE(&next_state, NEXT_LOADING);
+    pthread_create(&loader, NULL, load_next, NULL);
+}
+
+// makes the preloaded track the current one, returns false if it isn't ready
+static bool switch_track(void)
+{
+    if (ATOMIC_LOAD(&next_state) != NEXT_READY)
+        return false;
+    pthread_join(loader, NULL);
+    struct track* t = current;
+    current = next;
+    next = t;
+    track_free(next);
+    ATOMIC_STORE(&next_state, NEXT_IDLE);
+    update_metadata(current->config.data);
+    return true;
+}
+
+// frames left in track at encoder samplerate, 0 if unknown
+static long track_remaining(struct track* t)
+{
+    long remaining = t->remaining_frames;
+    if (t->info.frames > 0 && t->info.samplerate > 0) {
+        long frames = (double)t->info.frames * settings_encoder_samplerate / t->info.samplerate;
+        remaining = MIN(remaining, frames - t->played_frames);
+    } else if (remaining == LONG_MAX) {
+        remaining = 0;
+    }
+    return MAX(0, remaining);
+}
+
+static void free_pcm_slot(void* slot)
+{
+    stream_free(slot);
+}
+
+static void free_mp3_slot(void* slot)
+{
+    struct mp3_block* b = slot;
+    buffer_free(&b->data);
+}
+
 static void cast_free(void)
 {
-    shout_free(shout);
-    shout = NULL;
-    lame_close(lame);
-    lame = 0;
-    if (decoder.free)
-        decoder.free(&decoder);
-    stream_free(&stream0);
-    stream_free(&stream1);
+    for (int i = 0; i < output_count; i++) {
+        struct output* o = outputs + i;
+        shout_free(o->shout);
+        lame_close(o->lame);
+        queue_free(&o->pcm_queue, free_pcm_slot);
+        queue_free(&o->mp3_queue, free_mp3_slot);
+        memset(o, 0, sizeof *o);
+    }
+    output_count = 0;
+    if (ATOMIC_LOAD(&next_state) != NEXT_IDLE)
+        pthread_join(loader, NULL);
+    ATOMIC_STORE(&next_state, NEXT_IDLE);
+    track_free(current);
+    track_free(next);
+    stream_free(&block);
+    stream_free(&tail);
     buffer_free(&remote_buf);
-    buffer_free(&config_buf);
-    buffer_free(&lame_buf);
-    fx_resample_free(resampler);
-    resampler = NULL;
+    buffer_free(&play_buf);
 }
 
 static void cast_init(void)
 {
     shout_init();
-    shout = shout_new();
-    lame = lame_init();
-    lame_set_quality(lame, 2);
-    lame_set_brate(lame, settings_encoder_bitrate);
-    lame_set_num_channels(lame, settings_encoder_channels);
-    lame_set_in_samplerate(lame, settings_encoder_samplerate);
-    lame_init_params(lame);
-    buffer_resize(&lame_buf, BUFFER_SIZE * settings_encoder_bitrate);
+    ff_set_threads(settings_decoder_threads);
+    ff_set_probing(settings_decoder_probesize, settings_decoder_analyze_ms);
+    ff_set_cache(settings_decoder_cache_kb * 1024L);
+    output_count = settings_profile_count;
+    for (int i = 0; i < output_count; i++) {
+        struct output* o = outputs + i;
+        o->profile = settings_profiles + i;
+        // lame does the downsampling and downmixing for each profile
+        o->lame = lame_init();
+        lame_set_quality(o->lame, 2);
+        lame_set_brate(o->lame, o->profile->bitrate);
+        lame_set_num_channels(o->lame, settings_encoder_channels);
+        lame_set_in_samplerate(o->lame, settings_encoder_samplerate);
+        lame_set_out_samplerate(o->lame, o->profile->samplerate);
+        if (o->profile->channels == 1)
+            lame_set_mode(o->lame, MONO);
+        lame_init_params(o->lame);
+        // two slots minimum, otherwise producer and consumer can't work at the same time
+        queue_init(&o->pcm_queue, MAX(2, settings_queue_pcm_ms / BUFFER_SIZE), sizeof (struct stream));
+        queue_init(&o->mp3_queue, MAX(2, settings_queue_mp3_ms / BUFFER_SIZE), sizeof (struct mp3_block));
+    }
 }
 
-static struct stream* process(int frames)
+// decodes <t> into <s> and applies the effect chain
+static void process(struct track* t, struct stream* s, int frames)
 {
-    struct stream* s = &stream0;
-    decoder.decode(&decoder, &stream0, frames);
-    if (resampler) {
-        fx_resample(resampler, &stream0, &stream1);
-        s = &stream1;
+    struct stream* in = t->resampler ? &t->stream : s;
+    if (!t->primed) {
+        t->decoder.decode(&t->decoder, in, frames);
+        if (t->resampler)
+            fx_resample(t->resampler, &t->stream, s);
+    } else {
+        // the block decoded ahead can be longer than asked for, the rest stays primed
+        struct stream part = {0};
+        stream_view(&part, &t->stream, 0, frames);
+        if (t->resampler) {
+            fx_resample(t->resampler, &part, s);
+        } else {
+            s->frames = 0;
+            stream_append(s, &part, part.frames);
+            s->end_of_stream = part.end_of_stream;
+        }
+        stream_drop(&t->stream, part.frames);
+        t->primed = t->stream.frames > 0;
     }
-    if (mixer_enabled)
-        fx_mix(&mixer, s);
-    fx_map(s, settings_encoder_channels);
-    fx_gain(s, gain);
-    if (fader_enabled)
-        fx_fade(&fader, s);
-    fx_clip(s);
-    return s;
+    fx_chain(&t->fx, s);
+
+    // forced length ends the track mid-block
+    if (s->frames >= t->remaining_frames) {
+        s->frames = t->remaining_frames;
+        s->end_of_stream = true;
+    }
+    t->remaining_frames -= s->frames;
+    t->played_frames += s->frames;
 }
 
-static bool cast_connect(void)
+// fills <s> with one block, seamlessly continues with next track when current ends
+static void process_block(struct stream* s, int frames)
+{
+    if (!track_loaded(current) && !switch_track()) {
+        start_loader();
+        stream_resize(s, frames, settings_encoder_channels);
+        stream_zero(s, 0, frames);
+        return;
+    }
+
+    process(current, s, frames);
+    if (track_remaining(current) <= settings_preload_seconds * settings_encoder_samplerate)
+        start_loader();
+    if (!s->end_of_stream)
+        return;
+
+    LOG_DEBUG("[cast] end of stream");
+    s->end_of_stream = false;
+    track_free(current);
+    if (s->frames < frames && switch_track()) {
+        process(current, &tail, frames - s->frames);
+        stream_append(s, &tail, tail.frames);
+    }
+}
+
+// returns new connection to icecast for <o>, or NULL on error
+static shout_t* cast_connect(struct output* o)
 {
     char bitrate[8]     = {0};
     char samplerate[8]  = {0};
     char channels[4]    = {0};
-    snprintf(bitrate, sizeof(bitrate), "%d", settings_encoder_bitrate);
-    snprintf(samplerate, sizeof(samplerate), "%d", settings_encoder_samplerate);
-    snprintf(channels, sizeof(channels), "%d", settings_encoder_channels); 
+    shout_t* shout      = shout_new();
+    snprintf(bitrate, sizeof(bitrate), "%d", o->profile->bitrate);
+    snprintf(samplerate, sizeof(samplerate), "%d", o->profile->samplerate);
+    snprintf(channels, sizeof(channels), "%d", o->profile->channels); 
 
     // setup connection
     shout_set_host(shout, settings_cast_host);
@@ -334,7 +608,7 @@ static bool cast_connect(void)
     shout_set_user(shout, settings_cast_user);
     shout_set_password(shout, settings_cast_password);
     shout_set_format(shout, SHOUT_FORMAT_MP3);
-    shout_set_mount(shout, settings_cast_mount);
+    shout_set_mount(shout, o->profile->mount);
     shout_set_public(shout, 1);
     shout_set_name(shout, settings_cast_name);
     shout_set_url(shout, settings_cast_url);
@@ -344,48 +618,202 @@ static bool cast_connect(void)
     shout_set_audio_info(shout, SHOUT_AI_SAMPLERATE, samplerate);
     shout_set_audio_info(shout, SHOUT_AI_CHANNELS, channels);
 
-    // start
+    // start, the sender doesn't block so the encoder can run ahead
+    shout_set_nonblocking(shout, 1);
     int err = shout_open(shout);
-    if (err != SHOUTERR_SUCCESS) 
-        LOG_ERROR("[cast] can't connect to icecast (%s)", shout_get_error(shout));
-    else
-        LOG_INFO("[cast] connected to icecast");
-    return err == SHOUTERR_SUCCESS;
+    for (int i = 0; err == SHOUTERR_BUSY && i < CONNECT_TIMEOUT * 100; i++) {
+        util_sleep_ms(10);
+        err = shout_get_connected(shout);
+    }
+    if (err == SHOUTERR_CONNECTED)
+        err = SHOUTERR_SUCCESS;
+    if (err != SHOUTERR_SUCCESS) {
+        LOG_ERROR("[cast] can't connect to icecast %s (%s)", o->profile->mount, shout_get_error(shout));
+        shout_free(shout);
+        return NULL;
+    }
+    LOG_INFO("[cast] connected to icecast %s", o->profile->mount);
+    return shout;
+}
+
+// replaces the connection of <o>, everything else keeps running. retries with increasing
+// delay until it's successful. meanwhile the output is stalled, buffered audio is kept
+static void reconnect(struct output* o)
+{
+    long backoff = MIN_BACKOFF;
+    ATOMIC_STORE(&o->stalled, true);
+    ATOMIC_STORE(&o->connected, false);
+    while (ATOMIC_LOAD(&running)) {
+        shout_t* shout = cast_connect(o);
+        if (shout) {
+            if (o->shout)
+                shout_free(o->shout);
+            o->shout = shout;
+            ATOMIC_STORE(&o->meta_pending, true);
+            ATOMIC_STORE(&o->connected, true);
+            return;
+        }
+        LOG_INFO("[cast] reconnecting %s in %ld ms", o->profile->mount, backoff);
+        for (long t = 0; t < backoff && ATOMIC_LOAD(&running); t += QUEUE_POLL)
+            util_sleep_ms(QUEUE_POLL);
+        backoff = MIN(backoff * 2, RETRY_TIME * 1000);
+    }
 }
 
+// encoder stage, pcm_queue -> mp3_queue. each output has its own encoder thread
+static void* encode_loop(void* data)
+{
+    struct output* o = data;
+
+    while (ATOMIC_LOAD(&running)) {
+        struct stream* s = queue_read_slot(&o->pcm_queue);
+        if (!s) {
+            util_sleep_ms(QUEUE_POLL);
+            continue;
+        }
+        long duration = (s->frames * 1000L) / settings_encoder_samplerate;
+        struct mp3_block* b = queue_write_slot(&o->mp3_queue);
+        if (!b && ATOMIC_LOAD(&o->stalled)) {
+            // nobody takes the data, throw it away in real time so other outputs keep going
+            queue_pop(&o->pcm_queue);
+            __atomic_add_fetch(&o->drops, 1, __ATOMIC_RELAXED);
+            util_sleep_ms(duration);
+            continue;
+        }
+        if (!b) {
+            util_sleep_ms(QUEUE_POLL);
+            continue;
+        }
+        // worst case mp3 size as documented by lame
+        buffer_resize(&b->data, (5 * s->frames) / 4 + 7200);
+        int siz = lame_encode_buffer_ieee_float(o->lame, s->buffer[0], s->buffer[1], s->frames, b->data.data, b->data.max_size);
+        queue_pop(&o->pcm_queue);
+        if (siz < 0) {
+            LOG_ERROR("[cast] lame error (%d)", siz);
+            ATOMIC_STORE(&running, false);
+            break;
+        }
+        b->data.size = siz;
+        b->duration = duration;
+        queue_push(&o->mp3_queue);
+        long fill = queue_fill(&o->mp3_queue);
+        if (fill > ATOMIC_LOAD(&o->high_water))
+            ATOMIC_STORE(&o->high_water, fill);
+    }
+    return NULL;
+}
+
+// sender stage, mp3_queue -> icecast. sends in real time, paced by monotonic clock
+static void* send_loop(void* data)
+{
+    struct output* o        = data;
+    long start              = util_time_ms();
+    long sent               = 0;       // miliseconds of audio sent 
+    long backlog_since      = 0;
+    long last_stats         = start;
+    long max_late           = MAX(BUFFER_SIZE, settings_queue_mp3_ms);
+
+    while (ATOMIC_LOAD(&running)) {
+        if (!ATOMIC_LOAD(&o->connected)) {
+            reconnect(o);
+            start = util_time_ms();
+            sent = 0;
+            continue;
+        }
+        long now = util_time_ms();
+        if (now - last_stats > STAT_INTERVAL * 1000) {
+            char stats[512] = {0};
+            print_stats(stats, sizeof stats, o);
+            LOG_INFO("[cast] %s", stats);
+            last_stats = now;
+        }
+        if (ATOMIC_LOAD(&o->meta_pending))
+            send_metadata(o);
+
+        // libshout keeps what couldn't be sent, push that out first
+        if (shout_queuelen(o->shout) > 0) {
+            int err = shout_send(o->shout, NULL, 0);
+            if (err != SHOUTERR_SUCCESS && err != SHOUTERR_BUSY) {
+                LOG_ERROR("[cast] disconnect %s (%s)", o->profile->mount, shout_get_error(o->shout));
+                ATOMIC_STORE(&o->connected, false);
+                continue;
+            }
+        }
+        if (shout_queuelen(o->shout) > 0) {
+            backlog_since = backlog_since ? backlog_since : now;
+            ATOMIC_STORE(&o->stalled, now - backlog_since > STALL_TIME);
+            util_sleep_ms(QUEUE_POLL);
+            continue;
+        }
+        backlog_since = 0;
+        ATOMIC_STORE(&o->stalled, false);
+
+        struct mp3_block* b = queue_read_slot(&o->mp3_queue);
+        long due = start + sent - BUFFER_SIZE;
+        if (!b || now < due) {
+            util_sleep_ms(QUEUE_POLL);
+            continue;
+        }
+        // after a stall catch up by at most one queue length
+        if (now - due > max_late) {
+            start = now - sent;
+            LOG_DEBUG("[cast] %s fell behind, resetting clock", o->profile->mount);
+        }
+        // on error the block stays in the queue and is sent after reconnect
+        int err = shout_send(o->shout, b->data.data, b->data.size);
+        if (err != SHOUTERR_SUCCESS && err != SHOUTERR_BUSY) {
+            LOG_ERROR("[cast] disconnect %s (%s)", o->profile->mount, shout_get_error(o->shout));
+            ATOMIC_STORE(&o->connected, false);
+            continue;
+        }
+        sent += b->duration;
+        queue_pop(&o->mp3_queue);
+    }
+    return NULL;
+}
+
+// true if every output can take another block
+static bool outputs_writable(void)
+{
+    for (int i = 0; i < output_count; i++)
+        if (!queue_write_slot(&outputs[i].pcm_queue))
+            return false;
+    return true;
+}
+
+// decoder stage, runs in calling thread until one of the stages fails
 static void main_loop(void)
 {
     int decode_frames = (settings_encoder_samplerate * BUFFER_SIZE) / 1000;
-    struct stream* s = &stream1;
 
-    while (true) {
+    ATOMIC_STORE(&running, true);
+    for (int i = 0; i < output_count; i++) {
+        pthread_create(&outputs[i].encoder, NULL, encode_loop, outputs + i);
+        pthread_create(&outputs[i].sender, NULL, send_loop, outputs + i);
+    }
+
+    while (ATOMIC_LOAD(&running)) {
         remote_handler();
-        if (!decoder_ready) {
-            stream_resize(s, decode_frames, s->channels);
-            stream_zero(s, 0, decode_frames);
-        } else {
-            s = process(decode_frames);
-            remaining_frames -= s->frames;
-            if (s->end_of_stream || remaining_frames < 0) { 
-                LOG_DEBUG("[cast] end of stream");
-                decoder_ready = false;
-                pthread_t thread = {0};
-                pthread_create(&thread, NULL, load_next, NULL);
-                pthread_detach(thread);
-            }
-        }
-        
-        int siz = lame_encode_buffer_ieee_float(lame, s->buffer[0], s->buffer[1], s->frames, lame_buf.data, lame_buf.size);
-        if (siz < 0) { 
-           LOG_ERROR("[cast] lame error (%d)", siz);
-           return;
+        if (!outputs_writable()) {
+            util_sleep_ms(QUEUE_POLL);
+            continue;
         }
-        shout_sync(shout);
-        int err = shout_send(shout, lame_buf.data, siz);
-        if (err != SHOUTERR_SUCCESS) {
-            LOG_ERROR("[cast] disconnect (%s)", shout_get_error(shout));
-            return;
+        long allocs = util_thread_allocs();
+        process_block(&block, decode_frames);
+        for (int i = 0; i < output_count; i++) {
+            struct stream* s = queue_write_slot(&outputs[i].pcm_queue);
+            s->frames = 0;
+            stream_append(s, &block, block.frames);
+            queue_push(&outputs[i].pcm_queue);
         }
+        // buffers only grow while they adapt to a track, after that they are reused
+        if (util_thread_allocs() != allocs && current->played_frames > WARMUP_TIME * settings_encoder_samplerate)
+            LOG_DEBUG("[cast] %ld heap allocations in steady state", util_thread_allocs() - allocs);
+    }
+
+    for (int i = 0; i < output_count; i++) {
+        pthread_join(outputs[i].encoder, NULL);
+        pthread_join(outputs[i].sender, NULL);
     }
 }
 
@@ -397,14 +825,13 @@ void cast_run(void)
         pthread_detach(thread);
     }
     atexit(cast_free);
-    while (true) {
+    // main_loop only returns on quit or encoder failure, connection problems are 
+    // handled by the sender threads
+    while (!quit) {
         cast_init();
-        if (cast_connect()) {
-            if (!decoder.handle)
-                load_next(NULL);
-            main_loop();
-        }
+        main_loop();
         cast_free();
-        sleep(RETRY_TIME); 
+        if (!quit)
+            sleep(RETRY_TIME); 
     }
 }
@@ -44,6 +44,7 @@
 #include "settings.h"
 #include "cast.h"
 #include "bassdecoder.h"
+#include "effects.h"
 
 int main(int argc, char** argv)
 {
@@ -57,6 +58,7 @@ int main(int argc, char** argv)
     settings_init(argc, argv);
     log_set_console_level(settings_log_console_level);
     log_set_file(settings_log_file, settings_log_file_level);
+    fx_init();
     puts("The spice must flow!");
     cast_run();
     return EXIT_SUCCESS;
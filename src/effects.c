@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <stdint.h>
 #include <limits.h>
 #include <assert.h>
 #include <samplerate.h>
@@ -69,6 +70,16 @@ void fx_resample_free(void* handle)
     free(r);
 }
 
+// drops the samples the converters hold back, they belong to the old position after a seek
+void fx_resample_reset(void* handle)
+{
+    if (!handle)
+        return;
+    struct fx_resampler* r = handle;
+    for (int ch = 0; ch < r->channels; ch++)
+        src_reset(r->state[ch]);
+}
+
 void fx_resample(void* handle, struct stream* s1, struct stream* s2)
 {
     struct fx_resampler* r = handle;
@@ -96,20 +107,183 @@ void fx_resample(void* handle, struct stream* s1, struct stream* s2)
 
 //-----------------------------------------------------------------------------
 
-void fx_map(struct stream* s, int channels)
+// the kernel is inlined with constant arguments, so the compiler generates a specialized
+// loop for every combination of channels and stages. the fade is split into segments with
+// constant and ramped amplitude, <inc> is the amplitude increment per frame.
+static inline __attribute__((always_inline)) void chain_kernel(struct fx_chain* fx, float** buf, long begin,
+    long end, float amp, float inc, const int in, const int out, const bool mix, const bool clip, const bool ramp)
+{
+    float* left = buf[0];
+    float* right = buf[1];
+    const float ll = fx->mix.llamp;
+    const float lr = fx->mix.lramp;
+    const float rr = fx->mix.rramp;
+    const float rl = fx->mix.rlamp;
+    for (long i = begin; i < end; i++) {
+        float l = left[i];
+        float r = (in == 2) ? right[i] : l;
+        if (mix && in == 2) {
+            float new_l = ll * l + lr * r;
+            r = rr * r + rl * l;
+            l = new_l;
+        }
+        if (out == 1 && in == 2)
+            l = (l + r) / 2;
+        const float a = ramp ? amp + inc * (i - begin) : amp;
+        l *= a;
+        r *= a;
+        if (clip) {
+            l = CLAMP(-1.0f, l, 1.0f);
+            r = CLAMP(-1.0f, r, 1.0f);
+        }
+        left[i] = l;
+        if (out == 2)
+            right[i] = r;
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+
+static const float iota[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+
+// vectorized chain_kernel, P is the intrinsics prefix (_mm or _mm256), V the vector type, W its width.
+// the scalar kernel handles the tail, so results match it within rounding of the ramp
+#define SIMD_KERNEL(isa, P, V, W)                                                               \
+static inline __attribute__((always_inline, target(#isa))) void chain_kernel_##isa(             \
+    struct fx_chain* fx, float** buf, long begin, long end, float amp, float inc,               \
+    const int in, const int out, const bool mix, const bool clip, const bool ramp)              \
+{                                                                                               \
+    float* left = buf[0];                                                                       \
+    float* right = buf[1];                                                                      \
+    const V ll = P##_set1_ps(fx->mix.llamp);                                                    \
+    const V lr = P##_set1_ps(fx->mix.lramp);                                                    \
+    const V rr = P##_set1_ps(fx->mix.rramp);                                                    \
+    const V rl = P##_set1_ps(fx->mix.rlamp);                                                    \
+    const V half = P##_set1_ps(0.5f);                                                           \
+    const V lo = P##_set1_ps(-1.0f);                                                            \
+    const V hi = P##_set1_ps(1.0f);                                                             \
+    const V vamp = P##_set1_ps(amp);                                                            \
+    const V vinc = P##_set1_ps(inc);                                                            \
+    const V step = P##_set1_ps(W);                                                              \
+    V index = P##_loadu_ps(iota);                                                               \
+    long i = begin;                                                                             \
+    for (; i + W <= end; i += W) {                                                              \
+        V l = P##_loadu_ps(left + i);                                                           \
+        V r = (in == 2) ? P##_loadu_ps(right + i) : l;                                          \
+        if (mix && in == 2) {                                                                   \
+            V new_l = P##_add_ps(P##_mul_ps(ll, l), P##_mul_ps(lr, r));                         \
+            r = P##_add_ps(P##_mul_ps(rr, r), P##_mul_ps(rl, l));                               \
+            l = new_l;                                                                          \
+        }                                                                                       \
+        if (out == 1 && in == 2)                                                                \
+            l = P##_mul_ps(P##_add_ps(l, r), half);                                             \
+        V a = vamp;                                                                             \
+        if (ramp) {                                                                             \
+            a = P##_add_ps(vamp, P##_mul_ps(vinc, index));                                      \
+            index = P##_add_ps(index, step);                                                    \
+        }                                                                                       \
+        l = P##_mul_ps(l, a);                                                                   \
+        r = P##_mul_ps(r, a);                                                                   \
+        if (clip) {                                                                             \
+            l = P##_min_ps(P##_max_ps(l, lo), hi);                                              \
+            r = P##_min_ps(P##_max_ps(r, lo), hi);                                              \
+        }                                                                                       \
+        P##_storeu_ps(left + i, l);                                                             \
+        if (out == 2)                                                                           \
+            P##_storeu_ps(right + i, r);                                                        \
+    }                                                                                           \
+    chain_kernel(fx, buf, i, end, amp + inc * (i - begin), inc, in, out, mix, clip, ramp);      \
+}
+
+SIMD_KERNEL(sse2, _mm, __m128, 4)
+SIMD_KERNEL(avx2, _mm256, __m256, 8)
+#endif
+
+typedef void (*chain_func)(struct fx_chain*, float**, long, long, float, float);
+
+#define chain_kernel_scalar chain_kernel
+#define CHAIN_KERNEL(isa, attr, in, out, mix, clip, ramp)                                       \
+    static attr void chain_##isa##in##out##mix##clip##ramp(struct fx_chain* fx, float** buf,    \
+        long begin, long end, float amp, float inc)                                             \
+    { chain_kernel_##isa(fx, buf, begin, end, amp, inc, in, out, mix, clip, ramp); }
+#define CHAIN_KERNELS(isa, attr, in, out)                                                       \
+    CHAIN_KERNEL(isa, attr, in, out, 0, 0, 0) CHAIN_KERNEL(isa, attr, in, out, 0, 0, 1)         \
+    CHAIN_KERNEL(isa, attr, in, out, 0, 1, 0) CHAIN_KERNEL(isa, attr, in, out, 0, 1, 1)         \
+    CHAIN_KERNEL(isa, attr, in, out, 1, 0, 0) CHAIN_KERNEL(isa, attr, in, out, 1, 0, 1)         \
+    CHAIN_KERNEL(isa, attr, in, out, 1, 1, 0) CHAIN_KERNEL(isa, attr, in, out, 1, 1, 1)
+#define CHAIN_ENTRIES(isa, in, out)                                                             \
+    chain_##isa##in##out##000, chain_##isa##in##out##001,                                       \
+    chain_##isa##in##out##010, chain_##isa##in##out##011,                                       \
+    chain_##isa##in##out##100, chain_##isa##in##out##101,                                       \
+    chain_##isa##in##out##110, chain_##isa##in##out##111
+// index is (in - 1) * 16 + (out - 1) * 8 + mix * 4 + clip * 2 + ramp
+#define CHAIN_TABLE(isa, attr)                                                                  \
+    CHAIN_KERNELS(isa, attr, 1, 1) CHAIN_KERNELS(isa, attr, 1, 2)                               \
+    CHAIN_KERNELS(isa, attr, 2, 1) CHAIN_KERNELS(isa, attr, 2, 2)                               \
+    static const chain_func chain_kernels_##isa[] = {                                           \
+        CHAIN_ENTRIES(isa, 1, 1), CHAIN_ENTRIES(isa, 1, 2),                                     \
+        CHAIN_ENTRIES(isa, 2, 1), CHAIN_ENTRIES(isa, 2, 2)                                      \
+    };
+
+CHAIN_TABLE(scalar, )
+#ifdef HAVE_X86_SIMD
+CHAIN_TABLE(sse2, __attribute__((target("sse2"))))
+CHAIN_TABLE(avx2, __attribute__((target("avx2"))))
+#endif
+
+// selected once by fx_init, before any threads are started
+static const chain_func* chain_kernels = chain_kernels_scalar;
+
+void fx_chain_init(struct fx_chain* fx, int channels, float gain, int flags)
 {
-    // only handles 1 and 2, not MAX_CHANNELS
     assert(channels >= 1 && channels <= 2);
-    if (s->channels == 1 && channels == 2) {
-        stream_resize(s, s->frames, 2);
-        memmove(s->buffer[1], s->buffer[0], s->frames * sizeof (float));
-    } else if (s->channels == 2 && channels == 1) {
-        s->channels = 1;
-        float* left = s->buffer[0];
-        float* right = s->buffer[1];
-        for (int i = 0; i < s->frames; i++) 
-            left[i] = (left[i] + right[i]) / 2;
+    memset(fx, 0, sizeof *fx);
+    fx->channels    = channels;
+    fx->gain        = gain;
+    fx->flags       = flags;
+    fx->fade.amp    = 1;
+    fx_mix_init(&fx->mix, 1, 0, 1, 0);
+}
+
+void fx_chain(struct fx_chain* fx, struct stream* s)
+{
+    // only handles 1 and 2, not MAX_CHANNELS
+    assert(s->channels >= 1 && s->channels <= 2);
+    int in = s->channels;
+    int out = fx->channels;
+    if (out > in)
+        stream_resize(s, s->frames, out);
+    s->channels = out;
+
+    int index = (in - 1) * 16 + (out - 1) * 8 + ((fx->flags & FX_MIX) ? 4 : 0) + ((fx->flags & FX_CLIP) ? 2 : 0);
+    const chain_func ramp = chain_kernels[index + 1];
+    const chain_func flat = chain_kernels[index];
+
+    if (!(fx->flags & FX_FADE)) {
+        flat(fx, s->buffer, 0, s->frames, fx->gain, 0);
+        return;
     }
+
+    // fade segments: before start, ramp, after end
+    struct fx_fade* f = &fx->fade;
+    long enda = CLAMP(0, f->start_frame - f->current_frame, s->frames);
+    long endb = CLAMP(enda, f->end_frame - f->current_frame, s->frames);
+    f->current_frame += s->frames;
+    flat(fx, s->buffer, 0, enda, fx->gain * f->amp, 0);
+    ramp(fx, s->buffer, enda, endb, fx->gain * f->amp, fx->gain * f->amp_inc);
+    f->amp += f->amp_inc * (endb - enda);
+    flat(fx, s->buffer, endb, s->frames, fx->gain * f->amp, 0);
+}
+
+//-----------------------------------------------------------------------------
+
+void fx_map(struct stream* s, int channels)
+{
+    struct fx_chain fx = {{0}};
+    fx_chain_init(&fx, channels, 1, 0);
+    fx_chain(&fx, s);
 }
 
 //-----------------------------------------------------------------------------
@@ -127,35 +301,20 @@ void fx_fade_init(struct fx_fade* fx, long start_frame, long end_frame, float be
 
 void fx_fade(struct fx_fade* fx, struct stream* s)
 {
-    long enda = (fx->start_frame < fx->current_frame) ? 0 :
-        MIN(s->frames, fx->start_frame - fx->current_frame);
-    long endb = (fx->end_frame < fx->current_frame) ? 0 :
-        MIN(s->frames, fx->end_frame - fx->current_frame);
-    fx->current_frame += s->frames;
-    if (fx->amp == 1 && (enda >= s->frames || endb == 0)) 
-        return; // nothing to do; amp mignt not be exacly on target, so proximity check would be better
-    float a = fx->amp;
-    for (int ch = 0; ch < s->channels; ch++) {
-        float* out = s->buffer[ch];
-        for (int i = 0; i < enda; i++) 
-            out[i] *= a;
-        for (int i = 0; i < endb; i++, a += fx->amp_inc) 
-            out[i] *= a;
-        for (int i = 0; i < s->frames; i++) 
-            *out++ *= a;
-    }
-    fx->amp += fx->amp_inc * (endb - enda);
+    struct fx_chain chain = {{0}};
+    fx_chain_init(&chain, s->channels, 1, FX_FADE);
+    chain.fade = *fx;
+    fx_chain(&chain, s);
+    *fx = chain.fade;
 }
 
 //-----------------------------------------------------------------------------
 
 void fx_gain(struct stream* s, float amp)
 {
-    for (int ch = 0; ch < s->channels; ch++) {
-        float* out = s->buffer[ch];
-        for (int i = 0; i < s->frames; i++) 
-            out[i] *= amp;
-    }
+    struct fx_chain fx = {{0}};
+    fx_chain_init(&fx, s->channels, amp, 0);
+    fx_chain(&fx, s);
 }
 
 //-----------------------------------------------------------------------------
@@ -172,82 +331,151 @@ void fx_mix(struct fx_mix* fx, struct stream* s)
 {
     if (s->channels != 2)
         return;
-    float* left = s->buffer[0];
-    float* right = s->buffer[1];
-    for (int i = 0; i < s->frames; i++) {
-        float new_left = fx->llamp * left[i] + fx->lramp * right[i];
-        float new_right = fx->rramp * right[i] + fx->rlamp * left[i];
-        left[i] = new_left;
-        right[i] = new_right;
-    }
+    struct fx_chain chain = {{0}};
+    fx_chain_init(&chain, 2, 1, FX_MIX);
+    chain.mix = *fx;
+    fx_chain(&chain, s);
 }
 
 //-----------------------------------------------------------------------------
 
 void fx_clip(struct stream* s)
 {
-    for (int ch = 0; ch < s->channels; ch++) {
-        float* buf = s->buffer[ch];
-        for (int i = 0; i < s->frames; i++)
-            buf[i] = CLAMP(-1.0f, buf[i], 1.0f);
-    }
+    struct fx_chain fx = {{0}};
+    fx_chain_init(&fx, s->channels, 1, FX_CLIP);
+    fx_chain(&fx, s);
 }
 
 //-----------------------------------------------------------------------------
 
-static void ci16i(const void** vin, float** out, int len, int channels)
+// sample formats are converted by one kernel per format. planar formats and mono are converted
+// channel by channel, interleaved stereo is split while converting
+static inline __attribute__((always_inline)) float load_sample(const void* in, long i, const int type)
+{
+    switch (type & ~1) {
+    default:
+    case SF_INT16I:     return ((const int16_t*)in)[i] * (1.0f / 32768);
+    case SF_INT32I:     return ((const int32_t*)in)[i] * (1.0f / 2147483648.0f);
+    case SF_FLOAT32I:   return ((const float*)in)[i];
+    case SF_FLOAT64I:   return ((const double*)in)[i];
+    case SF_UINT8I:     return (((const uint8_t*)in)[i] - 128) * (1.0f / 128);
+    }
+}
+
+static inline __attribute__((always_inline)) void convert_kernel(const void** in, float** out, long begin, long len,
+    int channels, const int type)
 {
-    const int16_t* in = vin[0]; 
-    float* lout = out[0];
-    if (channels == 1) {
-        for (int i = 0; i < len; i++) 
-            lout[i] = (float)in[i] / -INT16_MIN;
+    if ((type & 1) || channels == 1) {
+        for (int ch = 0; ch < channels; ch++)
+            for (long i = begin; i < len; i++)
+                out[ch][i] = load_sample(in[ch], i, type);
     } else { // channels == 2
-        float* rout = out[1];
-        for (int i = 0; i < len; i++) {
-            lout[i] = (float)in[i * 2] / -INT16_MIN;
-            rout[i] = (float)in[i * 2 + 1] / -INT16_MIN;
+        for (long i = begin; i < len; i++) {
+            out[0][i] = load_sample(in[0], i * 2, type);
+            out[1][i] = load_sample(in[0], i * 2 + 1, type);
         }
     }
 }
 
-static void ci16p(const void** vin, float** out, int len, int channels)
+#ifdef HAVE_X86_SIMD
+// loads 8 samples starting at <i> as float
+static inline __attribute__((always_inline, target("avx2"))) __m256 load_avx2(const void* in, long i, const int type)
 {
-    for (int ch = 0; ch < channels; ch++) {
-        const int16_t* in = vin[ch];
-        float* lout = out[ch];
-        for (int i = 0; i < len; i++) 
-            lout[i] = (float)in[i] / -INT16_MIN;
+    switch (type & ~1) {
+    default:
+    case SF_INT16I: {
+        __m128i v = _mm_loadu_si128((const __m128i*)((const int16_t*)in + i));
+        return _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v)), _mm256_set1_ps(1.0f / 32768));
+    }
+    case SF_INT32I: {
+        __m256i v = _mm256_loadu_si256((const __m256i*)((const int32_t*)in + i));
+        return _mm256_mul_ps(_mm256_cvtepi32_ps(v), _mm256_set1_ps(1.0f / 2147483648.0f));
+    }
+    case SF_FLOAT32I:
+        return _mm256_loadu_ps((const float*)in + i);
+    case SF_FLOAT64I: {
+        __m128 lo = _mm256_cvtpd_ps(_mm256_loadu_pd((const double*)in + i));
+        __m128 hi = _mm256_cvtpd_ps(_mm256_loadu_pd((const double*)in + i + 4));
+        return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+    }
+    case SF_UINT8I: {
+        __m128i v = _mm_loadl_epi64((const __m128i*)((const uint8_t*)in + i));
+        __m256 f = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v));
+        return _mm256_mul_ps(_mm256_sub_ps(f, _mm256_set1_ps(128)), _mm256_set1_ps(1.0f / 128));
+    }
     }
 }
 
-static void cf32i(const void** vin, float** out, int len, int channels)
+static inline __attribute__((always_inline, target("avx2"))) void convert_kernel_avx2(const void** in, float** out,
+    long begin, long len, int channels, const int type)
 {
-    if (channels == 1) {
-        memmove(out[0], vin[0], len * sizeof(float));
+    long i = begin;
+    if ((type & 1) || channels == 1) {
+        for (int ch = 0; ch < channels; ch++)
+            for (i = begin; i + 8 <= len; i += 8)
+                _mm256_storeu_ps(out[ch] + i, load_avx2(in[ch], i, type));
     } else { // channels == 2
-        const float* in = vin[0];
-        float* lout = out[0];
-        float* rout = out[1];
-        for (int i = 0; i < len; i++) {
-            lout[i] = in[i * 2];
-            rout[i] = in[i * 2 + 1];
+        for (; i + 8 <= len; i += 8) {
+            __m256 a = load_avx2(in[0], i * 2, type);       // l0 r0 l1 r1 l2 r2 l3 r3
+            __m256 b = load_avx2(in[0], i * 2 + 8, type);   // l4 r4 l5 r5 l6 r6 l7 r7
+            __m256 l = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));    // l0 l1 l4 l5 l2 l3 l6 l7
+            __m256 r = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+            l = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(l), _MM_SHUFFLE(3, 1, 2, 0)));
+            r = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(r), _MM_SHUFFLE(3, 1, 2, 0)));
+            _mm256_storeu_ps(out[0] + i, l);
+            _mm256_storeu_ps(out[1] + i, r);
         }
     }
+    convert_kernel(in, out, i, len, channels, type);
 }
+#endif
 
-static void cf32p(const void** vin, float** out, int len, int channels)
-{
-    for (int ch = 0; ch < channels; ch++) 
-        memmove(out[ch], vin[ch], len * sizeof(float));
-}
+typedef void (*convert_func)(const void**, float**, int, int);
+
+#define convert_kernel_scalar convert_kernel
+#define CONVERT_FUNC(isa, attr, type)                                                           \
+    static attr void convert_##isa##type(const void** in, float** out, int len, int channels)   \
+    { convert_kernel_##isa(in, out, 0, len, channels, type); }
+#define CONVERT_TABLE(isa, attr)                                                                \
+    CONVERT_FUNC(isa, attr, 0) CONVERT_FUNC(isa, attr, 1) CONVERT_FUNC(isa, attr, 2)            \
+    CONVERT_FUNC(isa, attr, 3) CONVERT_FUNC(isa, attr, 4) CONVERT_FUNC(isa, attr, 5)            \
+    CONVERT_FUNC(isa, attr, 6) CONVERT_FUNC(isa, attr, 7) CONVERT_FUNC(isa, attr, 8)            \
+    CONVERT_FUNC(isa, attr, 9)                                                                  \
+    static const convert_func convert_##isa[] = {                                               \
+        convert_##isa##0, convert_##isa##1, convert_##isa##2, convert_##isa##3,                 \
+        convert_##isa##4, convert_##isa##5, convert_##isa##6, convert_##isa##7,                 \
+        convert_##isa##8, convert_##isa##9                                                      \
+    };
 
-static void (*convert[])(const void**, float**, int, int) = {ci16i, ci16p, cf32i, cf32p}; 
+CONVERT_TABLE(scalar, )
+#ifdef HAVE_X86_SIMD
+CONVERT_TABLE(avx2, __attribute__((target("avx2"))))
+#endif
+
+// selected by fx_init
+static const convert_func* convert = convert_scalar;
 
 void fx_convert_to_float(void** in, float** out, int type, int size, int channels)
 {
     // some converter functions only support 2, not MAX_CHANNELS
     assert(channels >= 1 && channels <= 2); 
-    assert(type >= SF_INT16I && type <= SF_FLOAT32P);
+    assert(type >= SF_INT16I && type <= SF_UINT8P);
     convert[type]((const void**)in, out, size, channels);
 }
+
+//-----------------------------------------------------------------------------
+
+void fx_init(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        chain_kernels = chain_kernels_avx2;
+        convert = convert_avx2;
+        LOG_DEBUG("[effects] using avx2 kernels");
+    } else if (__builtin_cpu_supports("sse2")) {
+        chain_kernels = chain_kernels_sse2;
+        LOG_DEBUG("[effects] using sse2 kernels");
+    }
+#endif
+}
@@ -30,6 +30,22 @@ struct fx_mix {
     float   rlamp;
 };
 
+#define FX_MIX          1
+#define FX_FADE         (1 << 1)
+#define FX_CLIP         (1 << 2)
+
+// mix, map, gain, fade and clip in a single pass over the stream
+struct fx_chain {
+    struct fx_mix   mix;
+    struct fx_fade  fade;
+    float           gain;
+    int             channels;       // output channels
+    int             flags;          // one or more of FX_*
+};
+
+// picks the fastest effect kernels for this cpu, call once at startup
+void    fx_init(void);
+
 float   db_to_amp(float db);
 float   amp_to_db(float amp);
 
@@ -41,6 +57,7 @@ void    fx_map(struct stream* s, int channels);
 
 void*   fx_resample_init(int channels, int sr_from, int sr_to);
 void    fx_resample_free(void* handle);
+void    fx_resample_reset(void* handle);
 void    fx_resample(void* handle, struct stream* s1, struct stream* s2);
 
 void    fx_fade_init(struct fx_fade* fx, long start_frame, long end_frame, float begin_amp, float end_amp);
@@ -49,6 +66,9 @@ void    fx_fade(struct fx_fade* fx, struct stream* s);
 void    fx_mix_init(struct fx_mix* fx, float llamp, float lramp, float rramp, float rlamp);
 void    fx_mix(struct fx_mix* fx, struct stream* s);
 
+void    fx_chain_init(struct fx_chain* fx, int channels, float gain, int flags);
+void    fx_chain(struct fx_chain* fx, struct stream* s);
+
 void    fx_convert_to_float(void** in, float** out, int type, int size, int channels);
 
 #endif // EFFECTS_H
@@ -8,131 +8,140 @@
 *   copyright MMXIII by maep
 */
 
-// on a general note, ffmpeg is a pain in the ass to work with because they change
-// their api a couple of times a year, sometimes for no good reason. they just
-// change a define or function name so it looks more pretty. and then i have
-// to go try and figure out in which version that happend. this is why this file
-// is full of #ifdefs which might be off by a few revisions. sorry.
+// ffmpeg changes its api a couple of times a year. only the send/receive api
+// (ffmpeg 4.1, libavcodec 58.35) and later is supported, the few differences
+// since then are handled with #ifdefs.
 // a good place to look, but it doesn't have all the information:
 // http://git.videolan.org/?p=ffmpeg.git;a=blob_plain;f=doc/APIchanges;hb=HEAD
 
-// fixes missing UINT64_C macro on some distros
-#define __STDC_CONSTANT_MACROS
-
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
-#ifdef FFMPEG_OLD_HEADER
-    #include <avcodec.h>
-    #include <avformat.h>
-#else
-    #include <libavcodec/avcodec.h>
-    #include <libavformat/avformat.h>
-#endif
+#include <pthread.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/intreadwrite.h>
 #include "log.h"
 #include "effects.h"
 #include "ffdecoder.h"
+#include "ffio.h"
+
+// channel layout api replaced channels in libavutil 57.28
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+    #define CHANNELS(ctx) ((ctx)->ch_layout.nb_channels)
+#else
+    #define CHANNELS(ctx) ((ctx)->channels)
+#endif
 
-#ifndef AV_VERSION_INT 
-    #define AV_VERSION_INT(a, b, c) (a << 16 | b << 8 | c)
+// side data sizes became size_t in libavcodec 59
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+    typedef size_t side_data_size;
+#else
+    typedef int side_data_size;
 #endif
 
-#define BUFFER_SIZE (AVCODEC_MAX_AUDIO_FRAME_SIZE)
+static int  decoder_threads = 1;
+static long probe_size;             // bytes, 0 is ffmpeg's default
+static long analyze_duration;       // miliseconds, 0 is ffmpeg's default
+static long cache_size = 1 << 20;   // read-ahead for urls in bytes
 
 struct ffdecoder {
+    struct ffio*        io;
     AVFormatContext*    format_context;
     AVCodecContext*     codec_context;
-    AVCodec*            codec;
-    AVPacket            packet;
-    AVPacket            tmp_packet;
-#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(53, 25, 0)
-    struct buffer       buffer;
-#endif
-    struct stream       stream;
+    const AVCodec*      codec;
+    AVPacket*           packet;             // reused for every packet
+    AVFrame*            frame;              // reused for every frame
+    struct stream       stream;             // decoded frames that didn't fit into the last block
+    struct buffer       tags;               // key-value string
     int                 stream_index;
     int                 format;
+    int                 sample_size;
+    int                 channels;
     long                frames;
+    bool                draining;           // no more packets, codec is flushed
 };
 
 static int get_format(AVCodecContext* codec_context)
 {
     switch (codec_context->sample_fmt) {
-#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(52, 95, 0)
-    case SAMPLE_FMT_S16:        return SF_INT16I;
-    case SAMPLE_FMT_FLT:        return SF_FLOAT32I;
-#else
     case AV_SAMPLE_FMT_S16:     return SF_INT16I;
     case AV_SAMPLE_FMT_FLT:     return SF_FLOAT32I;
-#endif
-#if LIBAVUTIL_VERSION_INT > AV_VERSION_INT(51, 26, 0)
+    case AV_SAMPLE_FMT_S32:     return SF_INT32I;
+    case AV_SAMPLE_FMT_DBL:     return SF_FLOAT64I;
+    case AV_SAMPLE_FMT_U8:      return SF_UINT8I;
     case AV_SAMPLE_FMT_S16P:    return SF_INT16P;
     case AV_SAMPLE_FMT_FLTP:    return SF_FLOAT32P;
-#endif
+    case AV_SAMPLE_FMT_S32P:    return SF_INT32P;
+    case AV_SAMPLE_FMT_DBLP:    return SF_FLOAT64P;
+    case AV_SAMPLE_FMT_U8P:     return SF_UINT8P;
     default:                    return -1;
     };
 }
 
-static void decode_frame(struct ffdecoder* d, AVPacket* p)
+// converts <frames> frames of d->frame, starting at <offset>, and appends them to <s>
+static void append_frame(struct ffdecoder* d, struct stream* s, int offset, int frames)
 {
-    void* packet_data = p->data;
-    int   packet_size = p->size;
-    
-    while (p->size > 0) {
-        int ret = 0;
-#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(53, 25, 0)
-        int data_size = BUFFER_SIZE;
-        int16_t* buf = d->buffer.data;
-#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(52, 23, 0)
-        ret = avcodec_decode_audio2(d->codec_context, buf, &data_size, p->data, p->size);
-#else
-        ret = avcodec_decode_audio3(d->codec_context, buf, &data_size, p);
-#endif
-        if (ret < 0)
-            goto error;
-        // TODO check format
-        int frames = data_size / (d->codec_context->channels * sizeof (int16_t));
-        void* buffs[MAX_CHANNELS] = {buf, buf + frames};
-        stream_append_convert(&d->stream, buffs, d->format, frames, d->codec_context->channels);
-#else
-        int got_frame = 0;
-        AVFrame frame = {{0}};
-        ret = avcodec_decode_audio4(d->codec_context, &frame, &got_frame, p);
-        if (ret < 0 || !got_frame)
-            goto error;
-        int frames = frame.nb_samples;
-        void** buffs = (void**)frame.extended_data;
-        stream_append_convert(&d->stream, buffs, d->format, frames, d->codec_context->channels);
-#endif
-        p->data += ret;
-        p->size -= ret;
-    }
+    void* buffs[MAX_CHANNELS] = {0};
+    bool planar = d->format & 1;
+    for (int ch = 0; ch < (planar ? d->channels : 1); ch++)
+        buffs[ch] = d->frame->extended_data[ch] + offset * d->sample_size * (planar ? 1 : d->channels);
+    stream_append_convert(s, buffs, d->format, frames, d->channels);
+}
+
+// receives the next frame into d->frame, reads and sends packets as needed.
+// returns false at the end of stream
+static bool receive_frame(struct ffdecoder* d)
+{
+    while (true) {
+        int err = avcodec_receive_frame(d->codec_context, d->frame);
+        if (!err)
+            return true;
+        if (err == AVERROR_EOF || d->draining)
+            return false;
+        // broken data, the decoder resyncs on the next packet
+        if (err != AVERROR(EAGAIN))
+            LOG_DEBUG("[ffdecoder] decode error (%s)", av_err2str(err));
 
-error:    
-    p->data = packet_data;
-    p->size = packet_size;
+        err = av_read_frame(d->format_context, d->packet);
+        if (err < 0) {
+            d->draining = true;
+            avcodec_send_packet(d->codec_context, NULL);
+            continue;
+        }
+        if (d->packet->stream_index == d->stream_index) {
+            err = avcodec_send_packet(d->codec_context, d->packet);
+            if (err < 0)
+                LOG_DEBUG("[ffdecoder] bad packet (%s)", av_err2str(err));
+        }
+        av_packet_unref(d->packet);
+    }
 }
 
 static void ff_decode(struct decoder* dec, struct stream* s, int frames)
 {
     struct ffdecoder* d = dec->handle;
-    
-    // preallocate stream to avoid a bunch of incremental resizes
-    stream_resize(&d->stream, frames * 2, d->codec_context->channels);
-    
-    while (d->stream.frames < frames) {
-        AVPacket packet = {0};
-        int err = av_read_frame(d->format_context, &packet);
-        if (err < 0) {
+
+    // leftovers from the last call first, then decode straight into <s>
+    s->frames = 0;
+    stream_resize(s, frames, d->channels);
+    if (d->stream.frames) {
+        stream_append(s, &d->stream, frames);
+        stream_drop(&d->stream, frames);
+    }
+
+    while (s->frames < frames && !d->stream.end_of_stream) {
+        if (!receive_frame(d)) {
             d->stream.end_of_stream = true;
-            break; 
+            break;
         }
-        if (packet.stream_index == d->stream_index) 
-            decode_frame(d, &packet);
-        av_free_packet(&packet);
+        int count = MIN(frames - s->frames, d->frame->nb_samples);
+        append_frame(d, s, 0, count);
+        if (count < d->frame->nb_samples)
+            append_frame(d, &d->stream, count, d->frame->nb_samples - count);
+        av_frame_unref(d->frame);
     }
-   
-    s->frames = 0;
-    stream_append(s, &d->stream, frames);
-    stream_drop(&d->stream, frames);
+
     s->end_of_stream = !d->stream.frames && d->stream.end_of_stream;
     if (s->end_of_stream) 
         LOG_DEBUG("[ffdecoder] eos avcodec %d frames left", s->frames);
@@ -141,48 +150,65 @@ static void ff_decode(struct decoder* dec, struct stream* s, int frames)
 static void ff_seek(struct decoder* dec, long frame)
 {
     struct ffdecoder* d = dec->handle;
-    int sr = d->codec_context->sample_rate;
-    int64_t timestamp = frame / sr * AV_TIME_BASE;
-    if (av_seek_frame(d->format_context, -1, timestamp, 0) < 0)
+    AVStream* stream = d->format_context->streams[d->stream_index];
+    AVRational samples = {1, d->codec_context->sample_rate};
+    int64_t start = stream->start_time == AV_NOPTS_VALUE ? 0 : stream->start_time;
+    int64_t timestamp = start + av_rescale_q(frame, samples, stream->time_base);
+    if (av_seek_frame(d->format_context, d->stream_index, timestamp, AVSEEK_FLAG_BACKWARD) < 0) {
         LOG_WARN("[ffdecoder] seek failed");
+        return;
+    }
+    avcodec_flush_buffers(d->codec_context);
+    d->stream.frames = 0;
+    d->stream.end_of_stream = false;
+    d->draining = false;
+
+    // the demuxer lands on a packet at or before <frame>, decode up to the exact position
+    while (true) {
+        if (!receive_frame(d)) {
+            d->stream.end_of_stream = true;
+            break;
+        }
+        int64_t pts = d->frame->best_effort_timestamp;
+        long first = pts == AV_NOPTS_VALUE ? frame : av_rescale_q(pts - start, stream->time_base, samples);
+        int frames = d->frame->nb_samples;
+        int skip = CLAMP(0, frame - first, frames);
+        if (skip < frames)
+            append_frame(d, &d->stream, skip, frames - skip);
+        av_frame_unref(d->frame);
+        if (skip < frames)
+            break;
+    }
 }
 
 static const char* codec_type(struct ffdecoder* d)
 {
-#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(54, 25, 0)
-    enum CodecID codec_type = d->codec->id;
-#else
     enum AVCodecID codec_type = d->codec->id;
-#endif
-    if (codec_type >= CODEC_ID_PCM_S16LE && codec_type < CODEC_ID_ADPCM_IMA_QT) 
+    if (codec_type >= AV_CODEC_ID_PCM_S16LE && codec_type < AV_CODEC_ID_ADPCM_IMA_QT) 
         return "pcm";
-    if (codec_type >= CODEC_ID_ADPCM_IMA_QT && codec_type < CODEC_ID_AMR_NB) 
+    if (codec_type >= AV_CODEC_ID_ADPCM_IMA_QT && codec_type < AV_CODEC_ID_AMR_NB) 
         return "adpcm";
     switch (codec_type) {
-        case CODEC_ID_RA_144:
-        case CODEC_ID_RA_288:   return "real";
-        case CODEC_ID_MP2:      return "mp2";
-        case CODEC_ID_MP3:      return "mp3";
-        case CODEC_ID_AAC:      return "aac";
-        case CODEC_ID_AC3:      return "ac3";
-        case CODEC_ID_VORBIS:   return "vorbis";
-#if LIBAVCODEC_VERSION_INT > AV_VERSION_INT(51, 50, 0)
-        case CODEC_ID_WMAVOICE:
-        case CODEC_ID_WMAPRO:
-        case CODEC_ID_WMALOSSLESS: 
-#endif
-        case CODEC_ID_WMAV1:
-        case CODEC_ID_WMAV2:    return "wma";
-        case CODEC_ID_FLAC:     return "flac";
-        case CODEC_ID_ALAC:     return "alac";
-        case CODEC_ID_WAVPACK:  return "wavpack";
-        case CODEC_ID_APE:      return "monkey";
-        case CODEC_ID_MUSEPACK7:
-        case CODEC_ID_MUSEPACK8:return "musepack";
-#if LIBAVCODEC_VERSION_INT > AV_VERSION_INT(54, 24, 0)
-        case CODEC_ID_OPUS:     return "opus";
-#endif
-        default:                return "unknown";
+        case AV_CODEC_ID_RA_144:
+        case AV_CODEC_ID_RA_288:    return "real";
+        case AV_CODEC_ID_MP2:       return "mp2";
+        case AV_CODEC_ID_MP3:       return "mp3";
+        case AV_CODEC_ID_AAC:       return "aac";
+        case AV_CODEC_ID_AC3:       return "ac3";
+        case AV_CODEC_ID_VORBIS:    return "vorbis";
+        case AV_CODEC_ID_WMAVOICE:
+        case AV_CODEC_ID_WMAPRO:
+        case AV_CODEC_ID_WMALOSSLESS: 
+        case AV_CODEC_ID_WMAV1:
+        case AV_CODEC_ID_WMAV2:     return "wma";
+        case AV_CODEC_ID_FLAC:      return "flac";
+        case AV_CODEC_ID_ALAC:      return "alac";
+        case AV_CODEC_ID_WAVPACK:   return "wavpack";
+        case AV_CODEC_ID_APE:       return "monkey";
+        case AV_CODEC_ID_MUSEPACK7:
+        case AV_CODEC_ID_MUSEPACK8: return "musepack";
+        case AV_CODEC_ID_OPUS:      return "opus";
+        default:                    return "unknown";
     }
 }
 
@@ -193,7 +219,7 @@ static void ff_info(struct decoder* dec, struct info* info)
     info->frames        = d->frames;
     info->codec         = codec_type(d);
     info->bitrate       = d->codec_context->bit_rate / 1000.0f;
-    info->channels      = d->codec_context->channels;
+    info->channels      = d->channels;
     info->samplerate    = d->codec_context->sample_rate;
     info->flags         = INFO_FFMPEG | INFO_SEEKABLE;
 }
@@ -201,35 +227,29 @@ static void ff_info(struct decoder* dec, struct info* info)
 static char* ff_metadata(struct decoder* dec, const char* key)
 {
     struct ffdecoder* d = dec->handle;
-    const char* value = NULL;
-#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(52, 83, 0)
-    if (!strcmp(key, "artist"))
-        value = d->format_context->author;
-    else if (!strcmp(key, "title"))
-        value = d->format_context->title;
-#else
-    AVDictionaryEntry* entry = av_dict_get(d->format_context->metadata, key, 0, 0);;
-    value = entry ? entry->value : NULL;
-#endif
-    char* v = util_strdup(value);
-    util_trim(v);
-    return v;
+    return keyval_str_dup(d->tags.data, key, NULL);
+}
+
+// copies all tags, ogg and friends keep theirs in the stream
+static void read_tags(struct ffdecoder* d)
+{
+    AVDictionary* dicts[] = {d->format_context->metadata, d->format_context->streams[d->stream_index]->metadata};
+    for (int i = 0; i < COUNT(dicts); i++) {
+        AVDictionaryEntry* entry = NULL;
+        while ((entry = av_dict_get(dicts[i], "", entry, AV_DICT_IGNORE_SUFFIX)))
+            keyval_append(&d->tags, entry->key, entry->value, -1);
+    }
 }
 
 static void ff_free2(struct ffdecoder* d)
 {
-#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(53, 8, 0)
-    buffer_free(&d->buffer);
-#endif
     stream_free(&d->stream);
-    if (d->codec_context)
-        avcodec_close(d->codec_context);
-    if (d->format_context)
-#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(53, 17, 0)
-        av_close_input_file(d->format_context);
-#else
-        avformat_close_input(&d->format_context);
-#endif
+    buffer_free(&d->tags);
+    av_frame_free(&d->frame);
+    av_packet_free(&d->packet);
+    avcodec_free_context(&d->codec_context);
+    avformat_close_input(&d->format_context);
+    ffio_close(d->io);
 }
 
 static void ff_free(struct decoder* dec)
@@ -240,74 +260,170 @@ static void ff_free(struct decoder* dec)
     memset(dec, 0, sizeof *dec);
 }
 
-bool ff_load(struct decoder* dec, const char* path)
+void ff_set_threads(int threads)
 {
-    // TODO reject input files with low score
-    static bool initialized = false;
-    if (!initialized) {
-        initialized = true;
-        av_register_all();
-#if LIBAVFORMAT_VERSION_INT > AV_VERSION_INT(53, 18, 0)
-        avformat_network_init();
-#endif
-#ifndef DEBUG
-        av_log_set_level(AV_LOG_QUIET);
-#endif
+    decoder_threads = MAX(0, threads);
+}
+
+void ff_set_cache(long bytes)
+{
+    cache_size = MAX(0, bytes);
+}
+
+void ff_set_probing(long probesize, long analyze_ms)
+{
+    probe_size = MAX(0, probesize);
+    analyze_duration = MAX(0, analyze_ms);
+}
+
+long ff_count_frames(struct decoder* dec)
+{
+    struct ffdecoder* d = dec->handle;
+    AVStream* stream = d->format_context->streams[d->stream_index];
+    int64_t duration = 0;
+    long skip = 0;
+    bool known = true;
+    while (known && av_read_frame(d->format_context, d->packet) >= 0) {
+        if (d->packet->stream_index == d->stream_index) {
+            // gapless mp3 and some other formats mark samples the decoder drops
+            side_data_size size = 0;
+            const uint8_t* side = av_packet_get_side_data(d->packet, AV_PKT_DATA_SKIP_SAMPLES, &size);
+            if (side && size >= 8)
+                skip += AV_RL32(side) + AV_RL32(side + 4);
+            duration += d->packet->duration;
+            known = d->packet->duration > 0;
+        }
+        av_packet_unref(d->packet);
     }
+    ff_seek(dec, 0);
+    if (!known)
+        return -1;
+    return MAX(0, av_rescale_q(duration, stream->time_base, (AVRational){1, d->codec_context->sample_rate}) - skip);
+}
 
-    LOG_DEBUG("[ffdecoder] loading %s", path);
-    
-    int err = 0;
-    struct ffdecoder d = {0};
-#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(52, 111, 0)
-    err = av_open_input_file(&d.format_context, path, 0, 0, 0);
-#else
-    err = avformat_open_input(&d.format_context, path, 0, 0);
-#endif
-    if (err) 
-        goto error;
-#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(53, 6, 0)
-    err = av_find_stream_info(d.format_context);
+// selects the audio stream and opens its codec. without <probe> the stream parameters
+// come from the header, and <samplerate> and <channels> fill the gaps
+static bool open_stream(struct ffdecoder* d, bool probe, int samplerate, int channels)
+{
+    avcodec_free_context(&d->codec_context);
+    if (probe && avformat_find_stream_info(d->format_context, NULL) < 0) 
+        return false;
+
+#if LIBAVFORMAT_VERSION_MAJOR < 59
+    AVCodec* codec = NULL;
 #else
-    err = avformat_find_stream_info(d.format_context, NULL);
+    const AVCodec* codec = NULL;
 #endif
-    if (err < 0) 
-        goto error;
+    d->stream_index = av_find_best_stream(d->format_context, AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0);
+    if (d->stream_index < 0)
+        return false;
+    d->codec = codec;
 
-    for (unsigned i = 0; i < d.format_context->nb_streams; i++) {
-#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(52, 64, 0)
-        if (d.format_context->streams[i]->codec->codec_type == CODEC_TYPE_AUDIO)
+    // the demuxer drops packets of other streams, like cover art, before they're read
+    for (unsigned i = 0; i < d->format_context->nb_streams; i++)
+        if ((int)i != d->stream_index)
+            d->format_context->streams[i]->discard = AVDISCARD_ALL;
+
+    AVStream* stream = d->format_context->streams[d->stream_index];
+    d->codec_context = avcodec_alloc_context3(d->codec);
+    if (!d->codec_context)
+        return false;
+    if (avcodec_parameters_to_context(d->codec_context, stream->codecpar) < 0)
+        return false;
+    if (d->codec_context->sample_rate <= 0)
+        d->codec_context->sample_rate = samplerate;
+    if (CHANNELS(d->codec_context) <= 0 && channels > 0)
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+        av_channel_layout_default(&d->codec_context->ch_layout, channels);
 #else
-        if (d.format_context->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO)
+        d->codec_context->channels = channels;
 #endif
-            d.stream_index = i;
-            break;
-    }
-    if (d.stream_index == -1)
-        goto error;
+    d->codec_context->thread_count = decoder_threads;
+    d->codec_context->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    if (avcodec_open2(d->codec_context, d->codec, NULL) < 0)
+        return false;
 
-    d.codec_context = d.format_context->streams[d.stream_index]->codec;
-    d.codec = avcodec_find_decoder(d.codec_context->codec_id);
-    if (!d.codec) 
-        goto error;
+    d->format = get_format(d->codec_context);
+    d->sample_size = av_get_bytes_per_sample(d->codec_context->sample_fmt);
+    d->channels = CHANNELS(d->codec_context);
+    return d->format >= 0 && d->codec_context->sample_rate > 0 && d->channels >= 1 && d->channels <= MAX_CHANNELS;
+}
 
-    d.format = get_format(d.codec_context);
-    if (d.format < 0)
-        goto error;
+// length from the container, or from the stream header if the container wasn't probed
+static long stream_frames(struct ffdecoder* d)
+{
+    AVStream* stream = d->format_context->streams[d->stream_index];
+    int samplerate = d->codec_context->sample_rate;
+    if (d->format_context->duration > 0)
+        return av_rescale(d->format_context->duration, samplerate, AV_TIME_BASE);
+    if (stream->duration > 0)
+        return av_rescale_q(stream->duration, stream->time_base, (AVRational){1, samplerate});
+    return 0;
+}
 
-#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(53, 8, 0)
-    if (avcodec_open(d.codec_context, d.codec) < 0)
-#else
-    if (avcodec_open2(d.codec_context, d.codec, NULL) < 0)
+// scan loads files from several threads
+static void ff_init(void)
+{
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(58, 9, 100)
+    av_register_all();
+#endif
+    avformat_network_init();
+#ifndef DEBUG
+    av_log_set_level(AV_LOG_QUIET);
 #endif
+}
+
+bool ff_load(struct decoder* dec, const char* path, const char* options)
+{
+    // TODO reject input files with low score
+    static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+    pthread_once(&init_once, ff_init);
+
+    LOG_DEBUG("[ffdecoder] loading %s", path);
+    
+    struct ffdecoder d = {0};
+    AVDictionary* format_options = NULL;
+    if (probe_size > 0)
+        av_dict_set_int(&format_options, "probesize", MAX(32, probe_size), 0);
+    if (analyze_duration > 0)
+        av_dict_set_int(&format_options, "analyzeduration", analyze_duration * 1000, 0);
+    // our own io keeps blocking reads out of the decoder, ffmpeg opens the path if it can't
+    d.io = ffio_open(path, cache_size);
+    if (d.io && (d.format_context = avformat_alloc_context())) {
+        d.format_context->pb = ffio_context(d.io);
+        d.format_context->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+    int err = avformat_open_input(&d.format_context, path, NULL, &format_options);
+    av_dict_free(&format_options);
+    if (err) 
         goto error;
+
+    // known stream parameters let us skip probing, which decodes a few seconds
+    int samplerate = options ? keyval_int(options, "samplerate", 0) : 0;
+    int channels = options ? keyval_int(options, "channels", 0) : 0;
+    bool hinted = samplerate > 0 && channels > 0;
+    bool probed = !hinted;
+    if (!open_stream(&d, !hinted, samplerate, channels)) {
+        if (!hinted || !open_stream(&d, true, 0, 0))
+            goto error;
+        probed = true;
+        LOG_DEBUG("[ffdecoder] stream parameters not in header, probed anyway");
+    }
     
-    if (d.format_context->duration > 0) 
-        d.frames = d.format_context->duration * d.codec_context->sample_rate / AV_TIME_BASE;
+    d.frames = stream_frames(&d);
+    // fades and preloading need the length, without probing the demuxer may not know it
+    if (!d.frames && !probed) {
+        if (!open_stream(&d, true, samplerate, channels))
+            goto error;
+        d.frames = stream_frames(&d);
+        LOG_DEBUG("[ffdecoder] length not in header, probed anyway");
+    }
     
-#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(53, 25, 0)
-    buffer_resize(&d.buffer, BUFFER_SIZE);
-#endif
+    d.packet = av_packet_alloc();
+    d.frame = av_frame_alloc();
+    if (!d.packet || !d.frame)
+        goto error;
+    read_tags(&d);
     
     dec->free       = ff_free;
     dec->seek       = ff_seek;
@@ -328,12 +444,8 @@ error:
 
 bool ff_probe_name(const char* file_name)
 {
-    const char* ext[] = {".mp3", ".ogg", ".mp4", ".m4a" ".aac", ".wma", ".acc", ".flac", 
-        ".ac3", ".wav", ".ape", ".wv", ".mpc", ".mp+", ".mpp", ".ra", ".mp2"
-#if LIBAVCODEC_VERSION_INT > AV_VERSION_INT(54, 24, 0)
-        , ".opus"
-#endif
-    }; 
+    const char* ext[] = {".mp3", ".ogg", ".mp4", ".m4a", ".aac", ".wma", ".acc", ".flac", 
+        ".ac3", ".wav", ".ape", ".wv", ".mpc", ".mp+", ".mpp", ".ra", ".mp2", ".opus"}; 
     for (int i = 0; i < COUNT(ext); i++) {
         const char* tmp = strrchr(file_name, '.');
         if (tmp && !strcasecmp(tmp, ext[i])) 
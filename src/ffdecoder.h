@@ -1,20 +1,39 @@
-/*
-*   demosauce - fancy icecast source client
-*
-*   this source is published under the GPLv3 license.
-*   http://www.gnu.org/licenses/gpl.txt
-*   also, this is beerware! you are strongly encouraged to invite the
-*   authors of this software to a beer when you happen to meet them.
-*   copyright MMXIII by maep
-*/
-
-#ifndef FFDECODER_H
-#define FFDECODER_H
-
-#include "util.h"
-
-bool    ff_probe(const char* filename);
-bool    ff_load(struct decoder* dec, const char* file_name);
-
-#endif // FFDECODER_H
-
+/*
+*   demosauce - fancy icecast source client
+*
+*   this source is published under the GPLv3 license.
+*   http://www.gnu.org/licenses/gpl.txt
+*   also, this is beerware! you are strongly encouraged to invite the
+*   authors of this software to a beer when you happen to meet them.
+*   copyright MMXIII by maep
+*/
+
+#ifndef FFDECODER_H
+#define FFDECODER_H
+
+#include "util.h"
+
+// true if <filename> has the extension of a format ffmpeg can decode
+bool    ff_probe_name(const char* filename);
+/*  ff_load
+ *      opens <file_name>. <options> is a key-value string and may be NULL. if it holds
+ *      samplerate and channels, the slow stream probing is skipped.
+ *  ff_set_threads
+ *      number of threads for files loaded afterwards, 0 is one per core.
+ *  ff_set_cache
+ *      size of the read-ahead cache for urls in bytes. local files are memory mapped.
+ *  ff_set_probing
+ *      limits the bytes and miliseconds ffmpeg reads to detect a format, 0 is ffmpeg's default.
+ *  ff_count_frames
+ *      exact length of a decoder loaded with ff_load, from the packet durations without
+ *      decoding. reads the whole file and seeks back to the start. -1 if a packet has no
+ *      duration.
+ */
+bool    ff_load(struct decoder* dec, const char* file_name, const char* options);
+void    ff_set_threads(int threads);
+void    ff_set_cache(long bytes);
+void    ff_set_probing(long probesize, long analyze_ms);
+long    ff_count_frames(struct decoder* dec);
+
+#endif // FFDECODER_H
+
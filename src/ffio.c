@@ -0,0 +1,266 @@
+/*
+*   demosauce - fancy icecast source client
+*
+*   this source is published under the GPLv3 license.
+*   http://www.gnu.org/licenses/gpl.txt
+*   also, this is beerware! you are strongly encouraged to invite the
+*   authors of this software to a beer when you happen to meet them.
+*   copyright MMXIII by maep
+*/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <libavformat/avformat.h>
+#include "log.h"
+#include "util.h"
+#include "ffio.h"
+
+#define IO_BUFFER_SIZE  (32 * 1024)     // buffer between ffmpeg and our read function
+#define READ_SIZE       (64 * 1024)     // largest read of the read-ahead thread
+#define MIN_CACHE_SIZE  (2 * READ_SIZE)
+
+struct ffio {
+    AVIOContext*        context;
+    int64_t             pos;            // read position of ffmpeg
+    int64_t             size;           // -1 if unknown
+    // local file
+    const uint8_t*      map;
+    // url
+    AVIOContext*        source;
+    pthread_t           thread;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    uint8_t*            cache;
+    long                cache_size;
+    unsigned long       head;           // total bytes written by the thread
+    unsigned long       tail;           // total bytes read by ffmpeg
+    int                 error;          // set by the thread at end of stream
+    bool                quit;
+    bool                running;
+};
+
+//-----------------------------------------------------------------------------
+
+static int map_read(void* opaque, uint8_t* buf, int size)
+{
+    struct ffio* io = opaque;
+    int count = (int)MIN(size, io->size - io->pos);
+    if (count <= 0)
+        return AVERROR_EOF;
+    memcpy(buf, io->map + io->pos, count);
+    io->pos += count;
+    return count;
+}
+
+static int64_t map_seek(void* opaque, int64_t offset, int whence)
+{
+    struct ffio* io = opaque;
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:   return io->size;
+    case SEEK_SET:      break;
+    case SEEK_CUR:      offset += io->pos; break;
+    case SEEK_END:      offset += io->size; break;
+    default:            return AVERROR(EINVAL);
+    }
+    if (offset < 0 || offset > io->size)
+        return AVERROR(EINVAL);
+    io->pos = offset;
+    return offset;
+}
+
+static bool map_open(struct ffio* io, const char* path)
+{
+    long size = 0;
+    io->map = util_map(path, &size);
+    io->size = size;
+    // empty files are fine, ffmpeg will tell it's not a format it knows
+    return io->map || util_isfile(path);
+}
+
+//-----------------------------------------------------------------------------
+
+// lets a blocking network read return when the thread is stopped
+static int interrupt(void* opaque)
+{
+    struct ffio* io = opaque;
+    return ATOMIC_LOAD(&io->quit);
+}
+
+static void* read_ahead(void* data)
+{
+    struct ffio* io = data;
+    pthread_mutex_lock(&io->lock);
+    while (!io->quit) {
+        long fill = io->head - io->tail;
+        if (fill == io->cache_size) {
+            pthread_cond_wait(&io->cond, &io->lock);
+            continue;
+        }
+        // only the thread writes to the free part of the cache, so it can do so unlocked
+        long offset = io->head % io->cache_size;
+        long count = MIN(MIN(io->cache_size - fill, io->cache_size - offset), READ_SIZE);
+        pthread_mutex_unlock(&io->lock);
+        int ret = avio_read(io->source, io->cache + offset, count);
+        pthread_mutex_lock(&io->lock);
+        if (ret > 0) {
+            io->head += ret;
+        } else {
+            io->error = ret ? ret : AVERROR_EOF;
+            pthread_cond_broadcast(&io->cond);
+            break;
+        }
+        pthread_cond_broadcast(&io->cond);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+static void cache_start(struct ffio* io)
+{
+    io->head = io->tail = 0;
+    io->error = 0;
+    ATOMIC_STORE(&io->quit, false);
+    io->running = !pthread_create(&io->thread, NULL, read_ahead, io);
+    if (!io->running)
+        io->error = AVERROR(EAGAIN);
+}
+
+static void cache_stop(struct ffio* io)
+{
+    if (!io->running)
+        return;
+    pthread_mutex_lock(&io->lock);
+    ATOMIC_STORE(&io->quit, true);
+    pthread_cond_broadcast(&io->cond);
+    pthread_mutex_unlock(&io->lock);
+    pthread_join(io->thread, NULL);
+    io->running = false;
+}
+
+static int cache_read(void* opaque, uint8_t* buf, int size)
+{
+    struct ffio* io = opaque;
+    pthread_mutex_lock(&io->lock);
+    while (io->head == io->tail && !io->error)
+        pthread_cond_wait(&io->cond, &io->lock);
+    long fill = io->head - io->tail;
+    int count = (int)MIN(size, fill);
+    long offset = io->tail % io->cache_size;
+    long first = MIN(count, io->cache_size - offset);
+    memcpy(buf, io->cache + offset, first);
+    memcpy(buf + first, io->cache, count - first);
+    io->tail += count;
+    io->pos += count;
+    pthread_cond_broadcast(&io->cond);
+    int error = io->error;
+    pthread_mutex_unlock(&io->lock);
+    return count ? count : error;
+}
+
+static int64_t cache_seek(void* opaque, int64_t offset, int whence)
+{
+    struct ffio* io = opaque;
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:   return io->size;
+    case SEEK_SET:      break;
+    case SEEK_CUR:      offset += io->pos; break;
+    case SEEK_END:
+        if (io->size < 0)
+            return AVERROR(ENOSYS);
+        offset += io->size;
+        break;
+    default:            return AVERROR(EINVAL);
+    }
+
+    // short skips forward are served from the cache
+    pthread_mutex_lock(&io->lock);
+    bool cached = offset >= io->pos && offset - io->pos <= (int64_t)(io->head - io->tail);
+    if (cached) {
+        io->tail += offset - io->pos;
+        io->pos = offset;
+        pthread_cond_broadcast(&io->cond);
+    }
+    pthread_mutex_unlock(&io->lock);
+    if (cached)
+        return offset;
+
+    cache_stop(io);
+    // quit is still set from stopping the thread, it would interrupt the seek
+    ATOMIC_STORE(&io->quit, false);
+    int64_t ret = avio_seek(io->source, offset, SEEK_SET);
+    if (ret >= 0) {
+        io->pos = ret;
+    } else if (avio_seek(io->source, io->pos, SEEK_SET) < 0) {
+        // the source is somewhere unknown, reads must fail rather than return shifted data
+        io->head = io->tail = 0;
+        io->error = (int)ret;
+        return ret;
+    }
+    cache_start(io);
+    return ret;
+}
+
+static bool cache_open(struct ffio* io, const char* url, long cache_size)
+{
+    AVIOInterruptCB callback = {interrupt, io};
+    if (avio_open2(&io->source, url, AVIO_FLAG_READ, &callback, NULL) < 0)
+        return false;
+    io->size = avio_size(io->source);
+    io->cache_size = MAX(MIN_CACHE_SIZE, cache_size);
+    io->cache = util_malloc(io->cache_size, MEM_BUFFER);
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->cond, NULL);
+    cache_start(io);
+    return io->running;
+}
+
+//-----------------------------------------------------------------------------
+
+struct ffio* ffio_open(const char* path, long cache_size)
+{
+    struct ffio* io = calloc(1, sizeof *io);
+    bool is_url = strstr(path, "://") && strncmp(path, "file:", 5);
+    bool opened = is_url ? cache_open(io, path, cache_size) : map_open(io, path);
+    uint8_t* buffer = opened ? av_malloc(IO_BUFFER_SIZE) : NULL;
+    if (buffer)
+        io->context = avio_alloc_context(buffer, IO_BUFFER_SIZE, 0, io,
+            is_url ? cache_read : map_read, NULL, is_url ? cache_seek : map_seek);
+    if (!io->context) {
+        av_free(buffer);
+        ffio_close(io);
+        LOG_DEBUG("[ffio] can't open %s", path);
+        return NULL;
+    }
+    LOG_DEBUG("[ffio] opened %s %s", is_url ? "url" : "file", path);
+    return io;
+}
+
+AVIOContext* ffio_context(struct ffio* io)
+{
+    return io->context;
+}
+
+void ffio_close(struct ffio* io)
+{
+    if (!io)
+        return;
+    if (io->context) {
+        // ffmpeg may have replaced the buffer
+        av_freep(&io->context->buffer);
+        avio_context_free(&io->context);
+    }
+    util_unmap(io->map, io->size);
+    if (io->source) {
+        cache_stop(io);
+        avio_closep(&io->source);
+        pthread_mutex_destroy(&io->lock);
+        pthread_cond_destroy(&io->cond);
+    }
+    free(io->cache);
+    free(io);
+}
@@ -0,0 +1,31 @@
+/*
+*   demosauce - fancy icecast source client
+*
+*   this source is published under the GPLv3 license.
+*   http://www.gnu.org/licenses/gpl.txt
+*   also, this is beerware! you are strongly encouraged to invite the
+*   authors of this software to a beer when you happen to meet them.
+*   copyright MMXIII by maep
+*/
+
+#ifndef FFIO_H
+#define FFIO_H
+
+#include <libavformat/avio.h>
+
+/*  input for ffmpeg that keeps blocking reads out of the decoder
+ *  ffio_open
+ *      local files are memory mapped. urls are read by a background thread into a
+ *      cache of <cache_size> bytes. returns NULL if <path> can't be opened.
+ *  ffio_context
+ *      returns the AVIOContext to set as AVFormatContext.pb
+ *  ffio_close
+ *      stops the read-ahead thread and frees <io>. the format context must be closed first.
+ */
+struct ffio;
+
+struct ffio*    ffio_open(const char* path, long cache_size);
+AVIOContext*    ffio_context(struct ffio* io);
+void            ffio_close(struct ffio* io);
+
+#endif // FFIO_H
@@ -0,0 +1,548 @@
+/*
+*   demosauce - fancy icecast source client
+*
+*   this source is published under the GPLv3 license.
+*   http://www.gnu.org/licenses/gpl.txt
+*   also, this is beerware! you are strongly encouraged to invite the
+*   authors of this software to a beer when you happen to meet them.
+*   copyright MMXIII by maep
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include "log.h"
+#include "flacdecoder.h"
+
+#define BLOCK_STREAMINFO    0
+#define BLOCK_SEEKTABLE     3
+#define BLOCK_COMMENT       4
+#define SEEKPOINT_SIZE      18
+#define MAX_BITS            24      // higher resolutions are left to ffmpeg
+#define SEEK_SCAN           (16 * 1024)
+
+struct bits {
+    const uint8_t*  data;
+    long            size;           // bytes
+    long            pos;            // bits
+};
+
+struct frame_header {
+    long            sample;         // first sample of the frame
+    int             blocksize;
+    int             assignment;     // channel assignment, 0-7 independent, 8-10 stereo decorrelation
+    int             bits;
+};
+
+struct flacdecoder {
+    const uint8_t*  map;
+    long            map_size;
+    long            first_frame;    // file offset
+    long            pos;            // file offset of the next frame
+    const uint8_t*  seektable;
+    int             seekpoints;
+    struct buffer   tags;           // key-value string from the vorbis comments
+    int             min_blocksize;
+    int             max_blocksize;
+    int             samplerate;
+    int             channels;
+    int             bits;
+    long            frames;
+    int32_t*        block[MAX_CHANNELS];
+    long            block_start;    // first sample of the decoded block
+    int             block_frames;
+    int             block_pos;
+};
+
+static const int32_t fixed_coefs[5][4] = {{0}, {1}, {2, -1}, {3, -3, 1}, {4, -6, 4, -1}};
+
+//-----------------------------------------------------------------------------
+
+// next 57 bits, msb first. reading past the end gives zeros
+static inline uint64_t bits_peek(struct bits* b)
+{
+    long byte = b->pos >> 3;
+    uint64_t word = 0;
+    if (byte + 8 <= b->size) {
+        memcpy(&word, b->data + byte, 8);
+        word = __builtin_bswap64(word);
+    } else {
+        for (int i = 0; i < 8; i++)
+            word = word << 8 | (byte + i < b->size ? b->data[byte + i] : 0);
+    }
+    return word << (b->pos & 7);
+}
+
+static inline uint32_t bits_read(struct bits* b, int n)
+{
+    if (!n)
+        return 0;
+    uint64_t word = bits_peek(b);
+    b->pos += n;
+    return word >> (64 - n);
+}
+
+static inline int32_t bits_read_signed(struct bits* b, int n)
+{
+    if (!n)
+        return 0;
+    int64_t sign = (int64_t)1 << (n - 1);
+    return (int32_t)(((int64_t)bits_read(b, n) ^ sign) - sign);
+}
+
+static inline uint32_t bits_unary(struct bits* b)
+{
+    uint32_t count = 0;
+    while (b->pos < b->size * 8) {
+        uint64_t word = bits_peek(b) >> 7;
+        if (word) {
+            int zeros = __builtin_clzll(word) - 7;
+            b->pos += zeros + 1;
+            return count + zeros;
+        }
+        b->pos += 57;
+        count += 57;
+    }
+    return count;
+}
+
+static bool bits_ok(struct bits* b)
+{
+    return b->pos <= b->size * 8;
+}
+
+static uint8_t crc8(const uint8_t* p, int size)
+{
+    uint8_t crc = 0;
+    for (int i = 0; i < size; i++) {
+        crc ^= p[i];
+        for (int k = 0; k < 8; k++)
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+static unsigned long be(const uint8_t* p, int size)
+{
+    unsigned long value = 0;
+    for (int i = 0; i < size; i++)
+        value = value << 8 | p[i];
+    return value;
+}
+
+static unsigned long le32(const uint8_t* p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned long)p[3] << 24;
+}
+
+//-----------------------------------------------------------------------------
+
+// returns the size of the frame header at <p>, or 0 if there is none
+static int read_frame_header(struct flacdecoder* d, const uint8_t* p, long size, struct frame_header* h)
+{
+    static const int bits[8] = {0, 8, 12, 0, 16, 20, 24, 32};
+    if (size < 6 || p[0] != 0xff || (p[1] & 0xfe) != 0xf8)
+        return 0;
+    bool variable = p[1] & 1;
+    int size_code = p[2] >> 4;
+    int rate_code = p[2] & 15;
+    int bits_code = (p[3] >> 1) & 7;
+    h->assignment = p[3] >> 4;
+    if (!size_code || rate_code == 15 || h->assignment > 10 || bits_code == 3 || (p[3] & 1))
+        return 0;
+
+    // sample or frame number, utf-8 style coded
+    int extra = 0;
+    unsigned long number = p[4];
+    while (extra < 6 && (number & (0x40 >> extra)) && (number & 0x80))
+        extra++;
+    if ((number & 0x80) && (!extra || (extra == 6 && (number & 1))))
+        return 0;
+    number &= extra ? 0x3f >> extra : 0x7f;
+    int len = 5 + extra;
+    if (len + 5 > size)
+        return 0;
+    for (int i = 5; i < len; i++) {
+        if ((p[i] & 0xc0) != 0x80)
+            return 0;
+        number = number << 6 | (p[i] & 0x3f);
+    }
+
+    if (size_code == 1)
+        h->blocksize = 192;
+    else if (size_code <= 5)
+        h->blocksize = 576 << (size_code - 2);
+    else if (size_code == 6)
+        h->blocksize = p[len++] + 1;
+    else if (size_code == 7) {
+        h->blocksize = be(p + len, 2) + 1;
+        len += 2;
+    } else
+        h->blocksize = 256 << (size_code - 8);
+    len += rate_code == 12 ? 1 : (rate_code == 13 || rate_code == 14) ? 2 : 0;
+
+    h->bits = bits_code ? bits[bits_code] : d->bits;
+    h->sample = variable ? (long)number : (long)number * d->min_blocksize;
+    int channels = h->assignment < 8 ? h->assignment + 1 : 2;
+    if (channels != d->channels || h->bits != d->bits || h->blocksize > d->max_blocksize ||
+        crc8(p, len) != p[len])
+        return 0;
+    return len + 1;
+}
+
+static bool read_residual(struct bits* b, int32_t* out, int blocksize, int order)
+{
+    int method = bits_read(b, 2);
+    if (method > 1)
+        return false;
+    int param_bits = method ? 5 : 4;
+    uint32_t escape = method ? 31 : 15;
+    int partition_order = bits_read(b, 4);
+    int partition_size = blocksize >> partition_order;
+    if (partition_size << partition_order != blocksize || partition_size < order)
+        return false;
+
+    int i = order;
+    for (int p = 1; p <= 1 << partition_order; p++) {
+        int end = p * partition_size;
+        uint32_t k = bits_read(b, param_bits);
+        if (k == escape) {
+            int n = bits_read(b, 5);
+            for (; i < end; i++)
+                out[i] = bits_read_signed(b, n);
+        } else {
+            for (; i < end; i++) {
+                uint32_t v = bits_unary(b) << k | bits_read(b, k);
+                out[i] = (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+            }
+        }
+        if (!bits_ok(b))
+            return false;
+    }
+    return true;
+}
+
+static void predict(int32_t* out, int blocksize, const int32_t* coefs, int order, int shift)
+{
+    for (int i = order; i < blocksize; i++) {
+        int64_t sum = 0;
+        for (int j = 0; j < order; j++)
+            sum += (int64_t)coefs[j] * out[i - j - 1];
+        out[i] = (int32_t)((uint32_t)out[i] + (uint32_t)(sum >> shift));
+    }
+}
+
+static bool read_subframe(struct bits* b, int32_t* out, int blocksize, int bits)
+{
+    if (bits_read(b, 1))
+        return false;
+    int type = bits_read(b, 6);
+    int wasted = bits_read(b, 1) ? bits_unary(b) + 1 : 0;
+    bits -= wasted;
+    if (bits <= 0)
+        return false;
+
+    if (type == 0) {
+        int32_t value = bits_read_signed(b, bits);
+        for (int i = 0; i < blocksize; i++)
+            out[i] = value;
+    } else if (type == 1) {
+        for (int i = 0; i < blocksize; i++)
+            out[i] = bits_read_signed(b, bits);
+    } else if (type >= 8 && type <= 12) {
+        int order = type - 8;
+        if (order > blocksize)
+            return false;
+        for (int i = 0; i < order; i++)
+            out[i] = bits_read_signed(b, bits);
+        if (!read_residual(b, out, blocksize, order))
+            return false;
+        predict(out, blocksize, fixed_coefs[order], order, 0);
+    } else if (type >= 32) {
+        int32_t coefs[32];
+        int order = (type & 31) + 1;
+        if (order > blocksize)
+            return false;
+        for (int i = 0; i < order; i++)
+            out[i] = bits_read_signed(b, bits);
+        int precision = bits_read(b, 4) + 1;
+        int shift = bits_read_signed(b, 5);
+        if (precision == 16 || shift < 0)
+            return false;
+        for (int i = 0; i < order; i++)
+            coefs[i] = bits_read_signed(b, precision);
+        if (!read_residual(b, out, blocksize, order))
+            return false;
+        predict(out, blocksize, coefs, order, shift);
+    } else {
+        return false;
+    }
+
+    if (wasted)
+        for (int i = 0; i < blocksize; i++)
+            out[i] = (int32_t)((uint32_t)out[i] << wasted);
+    return bits_ok(b);
+}
+
+// decodes the frame at d->pos into d->block, samples are scaled to 32 bit
+static bool read_frame(struct flacdecoder* d)
+{
+    struct frame_header h;
+    long size = d->map_size - d->pos;
+    int len = read_frame_header(d, d->map + d->pos, size, &h);
+    if (!len)
+        return false;
+
+    struct bits b = {d->map + d->pos, size, len * 8};
+    for (int ch = 0; ch < d->channels; ch++) {
+        // the side channel needs one more bit
+        bool side = (h.assignment == 8 || h.assignment == 10) ? ch == 1 : h.assignment == 9 && ch == 0;
+        if (!read_subframe(&b, d->block[ch], h.blocksize, h.bits + side))
+            return false;
+    }
+    // the crc-16 footer isn't checked, the header crc is enough to stay in sync
+    b.pos = ((b.pos + 7) & ~7L) + 16;
+    if (!bits_ok(&b))
+        return false;
+
+    int32_t* l = d->block[0];
+    int32_t* r = d->block[1];
+    int shift = 32 - h.bits;
+    for (int i = 0; i < h.blocksize; i++) {
+        switch (h.assignment) {
+        // unsigned, so broken frames wrap instead of overflowing
+        case 8:     r[i] = (int32_t)((uint32_t)l[i] - (uint32_t)r[i]); break;
+        case 9:     l[i] = (int32_t)((uint32_t)l[i] + (uint32_t)r[i]); break;
+        case 10: {
+            int64_t mid = (int64_t)l[i] * 2 | (r[i] & 1);
+            int64_t side = r[i];
+            l[i] = (int32_t)((mid + side) >> 1);
+            r[i] = (int32_t)((mid - side) >> 1);
+            break;
+        }
+        }
+        for (int ch = 0; ch < d->channels; ch++)
+            d->block[ch][i] = (int32_t)((uint32_t)d->block[ch][i] << shift);
+    }
+
+    d->pos += b.pos / 8;
+    d->block_start = h.sample;
+    d->block_frames = h.blocksize;
+    d->block_pos = 0;
+    return true;
+}
+
+// finds the first frame in [from, to), returns its offset or -1
+static long find_frame(struct flacdecoder* d, long from, long to, struct frame_header* h)
+{
+    for (long pos = MAX(from, d->first_frame); pos < MIN(to, d->map_size - 1); pos++) {
+        const uint8_t* p = memchr(d->map + pos, 0xff, MIN(to, d->map_size) - pos);
+        if (!p)
+            break;
+        pos = p - d->map;
+        if (read_frame_header(d, p, d->map_size - pos, h))
+            return pos;
+    }
+    return -1;
+}
+
+//-----------------------------------------------------------------------------
+
+static void flac_decode(struct decoder* dec, struct stream* s, int frames)
+{
+    struct flacdecoder* d = dec->handle;
+    s->frames = 0;
+    s->end_of_stream = false;
+    stream_resize(s, frames, d->channels);
+    while (s->frames < frames) {
+        if (d->block_pos == d->block_frames) {
+            bool ok = read_frame(d);
+            if (!ok && d->pos < d->map_size) {
+                struct frame_header h;
+                long pos = find_frame(d, d->pos + 1, d->map_size, &h);
+                LOG_DEBUG("[flacdecoder] bad frame at %ld, skipping to %ld", d->pos, pos);
+                d->pos = pos < 0 ? d->map_size : pos;
+                ok = pos >= 0 && read_frame(d);
+            }
+            if (!ok) {
+                s->end_of_stream = true;
+                break;
+            }
+        }
+        int count = MIN(frames - s->frames, d->block_frames - d->block_pos);
+        void* src[MAX_CHANNELS] = {0};
+        for (int ch = 0; ch < d->channels; ch++)
+            src[ch] = d->block[ch] + d->block_pos;
+        stream_append_convert(s, src, SF_INT32P, count, d->channels);
+        d->block_pos += count;
+    }
+    if (s->end_of_stream)
+        LOG_DEBUG("[flacdecoder] eos %d frames left", s->frames);
+}
+
+static void flac_seek(struct decoder* dec, long frame)
+{
+    struct flacdecoder* d = dec->handle;
+    d->block_pos = d->block_frames = 0;
+    if (frame >= d->frames) {
+        d->pos = d->map_size;
+        return;
+    }
+    frame = MAX(0, frame);
+    long lo = d->first_frame;
+    long hi = d->map_size;
+
+    // the seek table narrows the range, placeholders have all bits set and sort last
+    for (int i = 0; i < d->seekpoints; i++) {
+        const uint8_t* point = d->seektable + i * SEEKPOINT_SIZE;
+        uint64_t sample = be(point, 8);
+        long offset = d->first_frame + be(point + 8, 8);
+        if (sample == UINT64_MAX || offset >= d->map_size)
+            break;
+        if (sample <= (uint64_t)frame)
+            lo = MAX(lo, offset);
+        else {
+            hi = MIN(hi, offset);
+            break;
+        }
+    }
+
+    // bisect on frame headers, then decode up to the exact sample
+    while (hi - lo > SEEK_SCAN) {
+        struct frame_header h;
+        long mid = lo + (hi - lo) / 2;
+        long pos = find_frame(d, mid, hi, &h);
+        if (pos < 0 || h.sample > frame)
+            hi = mid;
+        else
+            lo = pos;
+    }
+
+    d->pos = lo;
+    while (read_frame(d)) {
+        if (d->block_start + d->block_frames > frame) {
+            d->block_pos = CLAMP(0, frame - d->block_start, d->block_frames);
+            return;
+        }
+    }
+    d->block_pos = d->block_frames = 0;
+    LOG_WARN("[flacdecoder] seek to %ld failed", frame);
+}
+
+static void flac_info(struct decoder* dec, struct info* info)
+{
+    struct flacdecoder* d = dec->handle;
+    memset(info, 0, sizeof *info);
+    info->codec         = "flac";
+    info->bitrate       = (float)(d->map_size - d->first_frame) * d->samplerate / (125.0f * d->frames);
+    info->frames        = d->frames;
+    info->channels      = d->channels;
+    info->samplerate    = d->samplerate;
+    info->flags         = INFO_SEEKABLE;
+}
+
+static char* flac_metadata(struct decoder* dec, const char* key)
+{
+    struct flacdecoder* d = dec->handle;
+    return keyval_str_dup(d->tags.data, key, NULL);
+}
+
+// vorbis comments are "KEY=value" strings with little endian lengths
+static void read_comments(struct flacdecoder* d, const uint8_t* p, long size)
+{
+    const uint8_t* end = p + size;
+    if (size < 8 || (long)le32(p) > size - 8)
+        return;
+    p += 4 + le32(p);
+    long count = le32(p);
+    p += 4;
+    for (long i = 0; i < count && end - p >= 4; i++) {
+        long len = MIN((long)le32(p), end - p - 4);
+        const char* str = (const char*)p + 4;
+        const char* value = memchr(str, '=', len);
+        p += 4 + len;
+        if (!value || value - str >= 64)
+            continue;
+        char key[64] = {0};
+        memcpy(key, str, value - str);
+        for (char* k = key; *k; k++)
+            *k = tolower((unsigned char)*k);
+        keyval_append(&d->tags, strcmp(key, "tracknumber") ? key : "track", value + 1, len - (value + 1 - str));
+    }
+}
+
+static void flac_free(struct decoder* dec)
+{
+    struct flacdecoder* d = dec->handle;
+    util_unmap(d->map, d->map_size);
+    buffer_free(&d->tags);
+    for (int ch = 0; ch < MAX_CHANNELS; ch++)
+        free(d->block[ch]);
+    free(d);
+    memset(dec, 0, sizeof *dec);
+}
+
+static bool read_metadata(struct flacdecoder* d)
+{
+    const uint8_t* p = d->map;
+    if (d->map_size < 8 || memcmp(p, "fLaC", 4))
+        return false;
+    bool streaminfo = false;
+    bool last = false;
+    long pos = 4;
+    while (!last) {
+        if (pos + 4 > d->map_size)
+            return false;
+        last = p[pos] & 0x80;
+        int type = p[pos] & 0x7f;
+        long size = be(p + pos + 1, 3);
+        const uint8_t* block = p + pos + 4;
+        pos += 4 + size;
+        if (pos > d->map_size)
+            return false;
+        if (type == BLOCK_STREAMINFO && size >= 34) {
+            d->min_blocksize    = be(block, 2);
+            d->max_blocksize    = be(block + 2, 2);
+            d->samplerate       = be(block + 10, 3) >> 4;
+            d->channels         = ((block[12] >> 1) & 7) + 1;
+            d->bits             = ((block[12] & 1) << 4 | block[13] >> 4) + 1;
+            d->frames           = (long)(block[13] & 15) << 32 | be(block + 14, 4);
+            streaminfo = true;
+        } else if (type == BLOCK_SEEKTABLE) {
+            d->seektable = block;
+            d->seekpoints = size / SEEKPOINT_SIZE;
+        } else if (type == BLOCK_COMMENT) {
+            read_comments(d, block, size);
+        }
+    }
+    d->first_frame = d->pos = pos;
+    // without a length in the header there are no exact durations, ffmpeg can guess better
+    return streaminfo && d->frames > 0 && d->samplerate > 0 && d->channels <= MAX_CHANNELS &&
+        d->bits >= 4 && d->bits <= MAX_BITS && d->min_blocksize >= 16 && d->max_blocksize >= d->min_blocksize;
+}
+
+bool flac_load(struct decoder* dec, const char* path)
+{
+    struct flacdecoder* d = calloc(1, sizeof *d);
+    d->map = util_map(path, &d->map_size);
+    if (!d->map || !read_metadata(d)) {
+        LOG_DEBUG("[flacdecoder] can't decode %s", path);
+        util_unmap(d->map, d->map_size);
+        buffer_free(&d->tags);
+        free(d);
+        return false;
+    }
+    for (int ch = 0; ch < d->channels; ch++)
+        d->block[ch] = util_malloc(d->max_blocksize * sizeof (int32_t), MEM_BUFFER);
+
+    dec->free       = flac_free;
+    dec->seek       = flac_seek;
+    dec->info       = flac_info;
+    dec->metadata   = flac_metadata;
+    dec->decode     = flac_decode;
+    dec->handle     = d;
+
+    LOG_INFO("[flacdecoder] loaded %s", path);
+    return true;
+}
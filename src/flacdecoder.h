@@ -0,0 +1,23 @@
+/*
+*   demosauce - fancy icecast source client
+*
+*   this source is published under the GPLv3 license.
+*   http://www.gnu.org/licenses/gpl.txt
+*   also, this is beerware! you are strongly encouraged to invite the
+*   authors of this software to a beer when you happen to meet them.
+*   copyright MMXIII by maep
+*/
+
+#ifndef FLACDECODER_H
+#define FLACDECODER_H
+
+#include "util.h"
+
+/*  flac_load
+ *      opens a native flac file with up to 24 bit and a length in the header. the file is
+ *      memory mapped, seeking is sample accurate. returns false for anything else, which
+ *      is left to ffmpeg.
+ */
+bool    flac_load(struct decoder* dec, const char* path);
+
+#endif // FLACDECODER_H
@@ -45,9 +45,6 @@
     X(BOOL,         Init,                   5,int,DWORD,DWORD,void*,void*)              \
     X(int,          ErrorGetCode,           0)                                          \
     X(BOOL,         SetConfig,              2,DWORD,DWORD)                              \
-    X(HSTREAM,      StreamCreateFile,       5,BOOL,const void*,QWORD,QWORD,DWORD)       \
-    X(BOOL,         StreamFree,             1,HSTREAM)                                  \
-    X(QWORD,        StreamGetFilePosition,  2,HSTREAM,DWORD)                            \
     X(HMUSIC,       MusicLoad,              6,BOOL,const void*,QWORD,DWORD,DWORD,DWORD) \
     X(BOOL,         MusicFree,              1,HMUSIC)                                   \
     X(DWORD,        ChannelFlags,           3,DWORD,DWORD,DWORD)                        \
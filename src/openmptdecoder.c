@@ -0,0 +1,203 @@
+/*
+*   demosauce - fancy icecast source client
+*
+*   this source is published under the GPLv3 license.
+*   http://www.gnu.org/licenses/gpl.txt
+*   also, this is beerware! you are strongly encouraged to invite the
+*   authors of this software to a beer when you happen to meet them.
+*   copyright MMXIII by maep
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <libopenmpt/libopenmpt.h>
+#include "log.h"
+#include "openmptdecoder.h"
+
+// render params, see libopenmpt.h
+#define FILTER_DEFAULT      0
+#define FILTER_NONE         1
+#define FILTER_LINEAR       2
+#define FILTER_SINC         8
+#define RAMP_DEFAULT        -1
+#define RAMP_OFF            0
+#define RAMP_SENSITIVE      10
+#define SEEK_BLOCK          4096
+
+struct openmptdecoder {
+    openmpt_module*     module;
+    char*               type;               // mod, s3m, xm, it, ...
+    struct buffer       tags;               // key-value string
+    struct stream       skip;               // scratch for seeking
+    int                 samplerate;
+    long                current_frame;
+    long                last_frame;
+};
+
+#define IS_AMIGAMOD(d)  (!strcmp((d)->type, "mod"))
+
+static void openmpt_decode(struct decoder* dec, struct stream* s, int frames)
+{
+    struct openmptdecoder* d = dec->handle;
+    frames = CLAMP(0, d->last_frame - d->current_frame, frames);
+    s->frames = 0;
+    stream_resize(s, frames, 2);
+    // renders planar float, so this goes straight into the stream
+    size_t frames_read = openmpt_module_read_float_stereo(d->module, d->samplerate, frames,
+        s->buffer[0], s->buffer[1]);
+    s->frames = frames_read;
+    d->current_frame += frames_read;
+    s->end_of_stream = (frames_read != frames) || (d->current_frame >= d->last_frame);
+    if (s->end_of_stream)
+        LOG_DEBUG("[openmptdecoder] eos %d frames left", s->frames);
+}
+
+static void openmpt_seek(struct decoder* dec, long frame)
+{
+    // libopenmpt seeks to a row, the rest is rendered and thrown away
+    struct openmptdecoder* d = dec->handle;
+    frame = CLAMP(0, frame, d->last_frame);
+    double pos = openmpt_module_set_position_seconds(d->module, (double)frame / d->samplerate);
+    d->current_frame = MIN(frame, (long)(pos * d->samplerate));
+    while (d->current_frame < frame) {
+        openmpt_decode(dec, &d->skip, MIN(frame - d->current_frame, SEEK_BLOCK));
+        if (d->skip.end_of_stream)
+            break;
+    }
+}
+
+static void openmpt_info(struct decoder* dec, struct info* info)
+{
+    struct openmptdecoder* d = dec->handle;
+    memset(info, 0, sizeof *info);
+    info->codec         = d->type;
+    info->frames        = d->last_frame;
+    info->channels      = 2;
+    info->samplerate    = d->samplerate;
+    info->flags         = INFO_OPENMPT | INFO_MOD | INFO_SEEKABLE;
+    if (IS_AMIGAMOD(d))
+        info->flags |= INFO_AMIGAMOD;
+}
+
+static char* openmpt_metadata(struct decoder* dec, const char* key)
+{
+    struct openmptdecoder* d = dec->handle;
+    return keyval_str_dup(d->tags.data, key, NULL);
+}
+
+static void read_tags(struct openmptdecoder* d)
+{
+    const char* keys[] = {"title", "artist", "date", "tracker"};
+    for (int i = 0; i < COUNT(keys); i++) {
+        const char* value = openmpt_module_get_metadata(d->module, keys[i]);
+        keyval_append(&d->tags, keys[i], value, -1);
+        openmpt_free_string(value);
+    }
+}
+
+static void openmpt_free(struct decoder* dec)
+{
+    struct openmptdecoder* d = dec->handle;
+    if (d->module)
+        openmpt_module_destroy(d->module);
+    stream_free(&d->skip);
+    buffer_free(&d->tags);
+    free(d->type);
+    free(d);
+    memset(dec, 0, sizeof *dec);
+}
+
+void openmpt_set_loop_duration(struct decoder* dec, double duration)
+{
+    struct openmptdecoder* d = dec->handle;
+    d->last_frame = duration * d->samplerate;
+    openmpt_module_set_repeat_count(d->module, -1);
+}
+
+// translates the per-song bass options, so songs sound the same with either player
+static void apply_options(struct openmptdecoder* d, const char* options)
+{
+    // interpolation, values: auto, off, linear, sinc
+    char inter_str[8] = {0};
+    int filter = FILTER_LINEAR;
+    keyval_str(inter_str, 8, options, "bass_inter", "auto");
+    if ((IS_AMIGAMOD(d) && !strcmp(inter_str, "auto")) || !strcmp(inter_str, "off"))
+        filter = FILTER_NONE;
+    else if (!strcmp(inter_str, "sinc"))
+        filter = FILTER_SINC;
+    openmpt_module_set_render_param(d->module, OPENMPT_MODULE_RENDER_INTERPOLATIONFILTER_LENGTH, filter);
+
+    // ramping, values: auto, off, normal, sensitive
+    char ramp_str[12] = {0};
+    int ramp = RAMP_OFF;
+    keyval_str(ramp_str, 12, options, "bass_ramp", "auto");
+    if ((!IS_AMIGAMOD(d) && !strcmp(ramp_str, "auto")) || !strcmp(ramp_str, "normal"))
+        ramp = RAMP_DEFAULT;
+    else if (!strcmp(ramp_str, "sensitive"))
+        ramp = RAMP_SENSITIVE;
+    openmpt_module_set_render_param(d->module, OPENMPT_MODULE_RENDER_VOLUMERAMPING_STRENGTH, ramp);
+
+    // playback mode, values: auto, bass, pt1, ft2. libopenmpt follows the quirks of the tracker
+    // that made the file, so only the amiga resampler is left to switch
+    char mode_str[8] = {0};
+    keyval_str(mode_str, 8, options, "bass_mode", "auto");
+    bool amiga = (IS_AMIGAMOD(d) && !strcmp(mode_str, "auto")) || !strcmp(mode_str, "pt1");
+    openmpt_module_ctl_set_boolean(d->module, "render.resampler.emulate_amiga", amiga);
+}
+
+bool openmpt_load(struct decoder* dec, const char* path, const char* options, int samplerate)
+{
+    LOG_DEBUG("[openmptdecoder] loading %s", path);
+    struct openmptdecoder* d = calloc(1, sizeof *d);
+    d->samplerate = samplerate;
+    long size = 0;
+    const void* map = util_map(path, &size);
+    // libopenmpt copies the data, the file isn't needed after this
+    if (map)
+        d->module = openmpt_module_create_from_memory2(map, size, NULL, NULL,
+            NULL, NULL, NULL, NULL, NULL);
+    util_unmap(map, size);
+    if (!d->module) {
+        LOG_DEBUG("[openmptdecoder] failed to load %s", path);
+        openmpt_free(&(struct decoder){.handle = d});
+        return false;
+    }
+
+    const char* type = openmpt_module_get_metadata(d->module, "type");
+    d->type = util_strdup(type ? type : "unknown");
+    openmpt_free_string(type);
+
+    // the length comes from following the pattern order, nothing is rendered
+    double duration = openmpt_module_get_duration_seconds(d->module);
+    d->last_frame = duration > 0 ? (long)(duration * samplerate) : LONG_MAX;
+    apply_options(d, options);
+    read_tags(d);
+
+    dec->free       = openmpt_free;
+    dec->seek       = openmpt_seek;
+    dec->info       = openmpt_info;
+    dec->metadata   = openmpt_metadata;
+    dec->decode     = openmpt_decode;
+    dec->handle     = d;
+
+    LOG_INFO("[openmptdecoder] loaded %s", path);
+    return true;
+}
+
+bool openmpt_probe_name(const char* path)
+{
+    const char* ext = strrchr(path, '.');
+    if (ext && !strchr(ext, '/') && openmpt_is_extension_supported(ext + 1))
+        return true;
+
+    // amiga style prefix like mod.song
+    char prefix[8] = {0};
+    const char* name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    const char* dot = strchr(name, '.');
+    if (!dot || dot - name >= (long)sizeof prefix)
+        return false;
+    memcpy(prefix, name, dot - name);
+    return openmpt_is_extension_supported(prefix);
+}
@@ -0,0 +1,29 @@
+/*
+*   demosauce - fancy icecast source client
+*
+*   this source is published under the GPLv3 license.
+*   http://www.gnu.org/licenses/gpl.txt
+*   also, this is beerware! you are strongly encouraged to invite the
+*   authors of this software to a beer when you happen to meet them.
+*   copyright MMXIII by maep
+*/
+
+#ifndef OPENMPTDECODER_H
+#define OPENMPTDECODER_H
+
+#include "util.h"
+
+/*  module player built on libopenmpt
+ *  openmpt_load
+ *      loads the module <path> and renders it at <samplerate>. <options> takes the same
+ *      bass_inter, bass_ramp and bass_mode keys as the BASS decoder. returns false on error.
+ *  openmpt_probe_name
+ *      true if <path> has the extension or amiga style prefix of a format libopenmpt knows.
+ *  openmpt_set_loop_duration
+ *      loops the module until <duration> seconds are rendered.
+ */
+bool    openmpt_load(struct decoder* dec, const char* path, const char* options, int samplerate);
+bool    openmpt_probe_name(const char* path);
+void    openmpt_set_loop_duration(struct decoder* dec, double duration);
+
+#endif // OPENMPTDECODER_H
@@ -0,0 +1,263 @@
+/*
+*   demosauce - fancy icecast source client
+*
+*   this source is published under the GPLv3 license.
+*   http://www.gnu.org/licenses/gpl.txt
+*   also, this is beerware! you are strongly encouraged to invite the
+*   authors of this software to a beer when you happen to meet them.
+*   copyright MMXIII by maep
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "log.h"
+#include "ffdecoder.h"
+#include "wavdecoder.h"
+#include "flacdecoder.h"
+#ifdef ENABLE_BASS
+    #include "bassdecoder.h"
+#endif
+#ifdef ENABLE_OPENMPT
+    #include "openmptdecoder.h"
+#endif
+#include "probe.h"
+
+#define PROBE_SIZE      4096
+#define SYNC_SEARCH     4096        // junk bytes allowed before the first mp3 frame
+#define OGG_PAGE_MAX    65307       // the last page starts at most this far from the end
+
+struct magic {
+    int             type;
+    int             offset;
+    const char*     bytes;
+    int             size;
+};
+
+#define MAGIC(type, offset, bytes) {type, offset, bytes, sizeof (bytes) - 1}
+
+static const struct magic magics[] = {
+    MAGIC(PROBE_MODULE, 0,      "Extended Module: "),   // xm
+    MAGIC(PROBE_MODULE, 44,     "SCRM"),                // s3m
+    MAGIC(PROBE_MODULE, 0,      "IMPM"),                // it
+    MAGIC(PROBE_MODULE, 0,      "MTM"),
+    MAGIC(PROBE_MODULE, 0,      "MO3"),
+    MAGIC(PROBE_MODULE, 0,      "\xc1\x83\x2a\x9e"),    // umx, unreal package
+    MAGIC(PROBE_MODULE, 1080,   "M.K."),                // mod, protracker
+    MAGIC(PROBE_MODULE, 1080,   "M!K!"),
+    MAGIC(PROBE_MODULE, 1080,   "FLT4"),                // mod, startrekker
+    MAGIC(PROBE_MODULE, 1080,   "FLT8"),
+    MAGIC(PROBE_MODULE, 1080,   "4CHN"),
+    MAGIC(PROBE_MODULE, 1080,   "6CHN"),
+    MAGIC(PROBE_MODULE, 1080,   "8CHN"),
+    MAGIC(PROBE_STREAM, 0,      "ID3"),
+    MAGIC(PROBE_WAV,    8,      "WAVE"),
+    MAGIC(PROBE_STREAM, 0,      "RIFF"),                // avi, rf64 is "RF64"
+    MAGIC(PROBE_STREAM, 0,      "FORM"),                // aiff
+    MAGIC(PROBE_FLAC,   0,      "fLaC"),
+    MAGIC(PROBE_STREAM, 0,      "OggS"),                // vorbis, opus, flac
+    MAGIC(PROBE_STREAM, 4,      "ftyp"),                // mp4, m4a
+    MAGIC(PROBE_STREAM, 0,      "\x30\x26\xb2\x75"),    // asf, wma
+    MAGIC(PROBE_STREAM, 0,      "MAC "),                // monkey
+    MAGIC(PROBE_STREAM, 0,      "wvpk"),                // wavpack
+    MAGIC(PROBE_STREAM, 0,      "MP+"),                 // musepack sv7
+    MAGIC(PROBE_STREAM, 0,      "MPCK"),                // musepack sv8
+    MAGIC(PROBE_STREAM, 0,      ".ra\xfd"),             // real audio
+    MAGIC(PROBE_STREAM, 0,      "\x0b\x77")             // ac3
+};
+
+static int probe_magic(const unsigned char* buf, int size)
+{
+    for (int i = 0; i < COUNT(magics); i++) {
+        const struct magic* m = magics + i;
+        if (m->offset + m->size <= size && !memcmp(buf + m->offset, m->bytes, m->size))
+            return m->type;
+    }
+    // mpeg audio frame sync, 11 bits set, valid layer
+    if (size >= 2 && buf[0] == 0xff && (buf[1] & 0xe0) == 0xe0 && (buf[1] & 0x06))
+        return PROBE_STREAM;
+    // tracker mods with more channels use "xxCH" or "xxCN"
+    if (size >= 1084 && buf[1082] == 'C' && (buf[1083] == 'H' || buf[1083] == 'N') &&
+        buf[1080] >= '0' && buf[1080] <= '9' && buf[1081] >= '0' && buf[1081] <= '9')
+        return PROBE_MODULE;
+    return PROBE_UNKNOWN;
+}
+
+static int probe_name(const char* path)
+{
+#ifdef ENABLE_BASS
+    if (bass_probe(path))
+        return PROBE_MODULE;
+#endif
+#ifdef ENABLE_OPENMPT
+    if (openmpt_probe_name(path))
+        return PROBE_MODULE;
+#endif
+    if (ff_probe_name(path))
+        return PROBE_STREAM;
+    return PROBE_UNKNOWN;
+}
+
+int probe_file(const char* path)
+{
+    if (strstr(path, "://"))
+        return PROBE_STREAM;
+
+    unsigned char buf[PROBE_SIZE];
+    int size = 0;
+    FILE* f = fopen(path, "rb");
+    if (f) {
+        size = fread(buf, 1, sizeof buf, f);
+        fclose(f);
+    }
+    int type = probe_magic(buf, size);
+    if (type == PROBE_UNKNOWN)
+        type = probe_name(path);
+    LOG_DEBUG("[probe] %s is %s", path, type == PROBE_MODULE ? "module" : type == PROBE_WAV ? "wav" :
+        type == PROBE_FLAC ? "flac" : type == PROBE_STREAM ? "stream" : "unknown");
+    return type;
+}
+
+// module_player picks the preferred player, the other one is tried if it fails
+static bool load_module(struct decoder* dec, const char* path, const char* options, int samplerate)
+{
+    char player[8] = {0};
+    keyval_str(player, sizeof player, options, "module_player", "auto");
+    bool loaded = false;
+#ifdef ENABLE_OPENMPT
+    bool openmpt_first = !strcmp(player, "openmpt");
+    loaded = openmpt_first && openmpt_load(dec, path, options, samplerate);
+#endif
+#ifdef ENABLE_BASS
+    loaded = loaded || bass_load(dec, path, options, samplerate);
+#endif
+#ifdef ENABLE_OPENMPT
+    loaded = loaded || (!openmpt_first && openmpt_load(dec, path, options, samplerate));
+#endif
+    if (!loaded)
+        LOG_WARN("[probe] no module player could load %s", path);
+    return loaded;
+}
+
+bool probe_load(struct decoder* dec, const char* path, const char* options, int samplerate)
+{
+    switch (probe_file(path)) {
+    case PROBE_MODULE:
+        return load_module(dec, path, options, samplerate);
+    case PROBE_WAV:
+        return wav_load(dec, path) || ff_load(dec, path, options);
+    case PROBE_FLAC:
+        return flac_load(dec, path) || ff_load(dec, path, options);
+    case PROBE_STREAM:
+    default:
+        // formats without magic or extension get a go with ffmpeg's own probing
+        return ff_load(dec, path, options);
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+static uint32_t be32(const uint8_t* p)
+{
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint32_t le32(const uint8_t* p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// frame count from a xing/info or vbri header in the first frame. the lame tag has the
+// encoder delay and padding, which ffmpeg drops as well
+static long mp3_length(const uint8_t* p, long size, int samplerate)
+{
+    long pos = 0;
+    if (size >= 10 && !memcmp(p, "ID3", 3))
+        pos = 10 + ((p[6] & 127) << 21 | (p[7] & 127) << 14 | (p[8] & 127) << 7 | (p[9] & 127)) +
+            ((p[5] & 0x10) ? 10 : 0);
+    long end = MIN(size - 4, pos + SYNC_SEARCH);
+    while (pos < end && !(p[pos] == 0xff && (p[pos + 1] & 0xe0) == 0xe0))
+        pos++;
+    if (pos >= end)
+        return -1;
+
+    const uint8_t* h = p + pos;
+    int version = (h[1] >> 3) & 3;          // 0 is mpeg 2.5, 2 mpeg 2, 3 mpeg 1
+    int layer = (h[1] >> 1) & 3;            // 1 is layer 3
+    int bitrate = h[2] >> 4;
+    int rate = (h[2] >> 2) & 3;
+    bool mono = (h[3] >> 6) == 3;
+    if (version == 1 || layer != 1 || bitrate == 15 || rate == 3)
+        return -1;
+    static const int rates[] = {44100, 48000, 32000};
+    if (rates[rate] >> (version == 3 ? 0 : version == 2 ? 1 : 2) != samplerate)
+        return -1;
+    long frame_size = version == 3 ? 1152 : 576;
+
+    // xing is after the side info
+    const uint8_t* x = h + 4 + (version == 3 ? (mono ? 17 : 32) : (mono ? 9 : 17));
+    if (x + 148 <= p + size && (!memcmp(x, "Xing", 4) || !memcmp(x, "Info", 4))) {
+        uint32_t flags = be32(x + 4);
+        long frames = (flags & 1) ? be32(x + 8) : 0;
+        const uint8_t* lame = x + 12 + ((flags & 2) ? 4 : 0) + ((flags & 4) ? 100 : 0) + ((flags & 8) ? 4 : 0);
+        long padding = 0;
+        if (!memcmp(lame, "LAME", 4) || !memcmp(lame, "Lavf", 4) || !memcmp(lame, "Lavc", 4))
+            padding = (lame[21] << 4 | lame[22] >> 4) + ((lame[22] & 15) << 8 | lame[23]);
+        return frames > 0 ? MAX(0, frames * frame_size - padding) : -1;
+    }
+
+    const uint8_t* v = h + 36;
+    if (v + 18 <= p + size && !memcmp(v, "VBRI", 4)) {
+        long frames = be32(v + 14);
+        return frames > 0 ? frames * frame_size : -1;
+    }
+    return -1;
+}
+
+// granule position of the last page. only for single vorbis, opus and flac streams,
+// chained or multiplexed files are left to ffmpeg
+static long ogg_length(const uint8_t* p, long size, int samplerate)
+{
+    if (size < 27 || memcmp(p, "OggS", 4) || size < 27 + p[26] + 35)
+        return -1;
+    uint32_t serial = le32(p + 14);
+    const uint8_t* packet = p + 27 + p[26];
+    long rate = 0;
+    long skip = 0;
+    if (!memcmp(packet, "\x01vorbis", 7)) {
+        rate = le32(packet + 12);
+    } else if (!memcmp(packet, "OpusHead", 8)) {
+        rate = 48000;                                   // opus is always decoded at 48 khz
+        skip = packet[10] | packet[11] << 8;            // pre-skip
+    } else if (!memcmp(packet, "\x7f" "FLAC", 5)) {
+        const uint8_t* info = packet + 17;              // streaminfo
+        rate = info[10] << 12 | info[11] << 4 | info[12] >> 4;
+    }
+    if (rate != samplerate)
+        return -1;
+
+    for (long pos = size - 27; pos >= 0 && pos >= size - OGG_PAGE_MAX - 27; pos--) {
+        if (p[pos] != 'O' || memcmp(p + pos, "OggS", 4) || p[pos + 4])
+            continue;
+        if (le32(p + pos + 14) != serial)
+            return -1;
+        int64_t granule = (int64_t)((uint64_t)le32(p + pos + 10) << 32 | le32(p + pos + 6));
+        if (granule >= 0)                               // -1 if no packet ends on this page
+            return granule >= skip ? granule - skip : -1;
+    }
+    return -1;
+}
+
+long probe_length(const char* path, int samplerate)
+{
+    long size = 0;
+    const uint8_t* p = util_map(path, &size);
+    long frames = -1;
+    if (p && size >= 4 && !memcmp(p, "OggS", 4))
+        frames = ogg_length(p, size, samplerate);
+    else if (p)
+        frames = mp3_length(p, size, samplerate);
+    util_unmap(p, size);
+    LOG_DEBUG("[probe] %s has %ld frames", path, frames);
+    return frames;
+}
@@ -0,0 +1,40 @@
+/*
+*   demosauce - fancy icecast source client
+*
+*   this source is published under the GPLv3 license.
+*   http://www.gnu.org/licenses/gpl.txt
+*   also, this is beerware! you are strongly encouraged to invite the
+*   authors of this software to a beer when you happen to meet them.
+*   copyright MMXIII by maep
+*/
+
+#ifndef PROBE_H
+#define PROBE_H
+
+#include "util.h"
+
+enum probe_type {
+    PROBE_UNKNOWN,
+    PROBE_STREAM,                   // mp3, ogg and everything else ffmpeg decodes
+    PROBE_MODULE,                   // tracker music
+    PROBE_WAV,                      // riff wave, uncompressed ones are decoded natively
+    PROBE_FLAC                      // native flac, ogg flac is a stream
+};
+
+/*  probe_file
+ *      identifies <path> by the magic bytes at its start, or by extension if that fails.
+ *      returns one of enum probe_type. urls aren't read and are always streams.
+ *  probe_load
+ *      loads <path> with the decoder for its type. <options> is the song's key-value string,
+ *      <samplerate> the rate for module players. wav and flac files the
+ *      built-in decoders can't handle go to ffmpeg. returns false on error.
+ *  probe_length
+ *      the exact number of frames ffmpeg decodes from <path>, taken from xing, lame and vbri
+ *      headers of mp3 files or the last ogg page. returns -1 if there is no such header or
+ *      its samplerate isn't <samplerate>. wav and flac have an exact length anyways.
+ */
+int     probe_file(const char* path);
+bool    probe_load(struct decoder* dec, const char* path, const char* options, int samplerate);
+long    probe_length(const char* path, int samplerate);
+
+#endif // PROBE_H
@@ -8,27 +8,48 @@
 *   copyright MMXIII by maep
 */
 
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <limits.h>
+#include <math.h>
+#include <stdarg.h>
 #include <getopt.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <replay_gain.h>
 #include "bassdecoder.h"
 #include "ffdecoder.h"
+#include "probe.h"
 #include "effects.h"
+#include "scanindex.h"
 #include "util.h"
 
 #define MAX_LENGTH      3600     // abort scan if track is too long, in seconds
 #define SAMPLERATE      44100 
+#define TAIL_LENGTH     20       // loopiness is measured over 1/20 s at the end
+#define MAX_DEPTH       32       // directory recursion limit, also stops symlink loops
 static const char* HELP_MESSAGE =
     "demosauce scan tool 0.4.0"ID_STR"\n"                                   
-    "syntax: scan [options] file\n"                                         
+    "syntax: scan [options] file...\n"                                      
     "   -h                      print help\n"                               
     "   -r                      disable replaygain analysis\n"              
-    "   -o file.wav, stdout     write to wav or stdout\n"                   
+    "   -f, --fast              with -r, take the length from the file headers or\n"
+    "                           packets instead of decoding\n"
+    "   -i file                 keep results in an index, unchanged files aren't\n"
+    "                           decoded again\n"
+    "   -j jobs                 files scanned in parallel, default 0 is one per core\n"
+    "   -t threads              decoder threads, default 0 is one per core\n"
+    "                           or 1 when scanning several files\n"
+    "   -o file.wav, stdout     write to wav or stdout, single file only\n"
     "                           format is 16 bit, 44.1 khz, stereo\n"       
-    "                           stdout is raw data, and has no wav header";
+    "                           stdout is raw data, and has no wav header\n"
+    "several files, directories (recursive) or - to read paths from stdin\n"
+    "are scanned in batch mode, which prints one json object per line";
 
 // for some formats avcodec fails to provide a bitrate so I just
 // make an educated guess. if the file contains large amounts of 
@@ -106,91 +127,210 @@ static void write_wav(FILE* f, struct stream* s)
     }
 }
 
-int main(int argc, char** argv)
+// keeps the last <size> frames of the decoded audio, mixed to mono
+static void keep_tail(float* tail, long size, long* pos, const struct stream* s)
 {
-    const char*     path        = NULL;
-    bool            analyze     = true;
-    bool            loaded      = false;
-    struct info     info        = {0};
-    struct decoder  decoder     = {0};
-    void*           resampler   = NULL;
-    struct stream   stream0     = {{0}};
-    struct stream   stream1     = {{0}};
-    struct stream*  stream      = &stream0;
-    FILE*           output      = NULL;
+    const float* right = s->buffer[s->channels == 1 ? 0 : 1];
+    for (long i = MAX(0, s->frames - size); i < s->frames; i++)
+        tail[(*pos)++ % size] = (s->buffer[0][i] + right[i]) / 2;
+}
 
-#ifdef ENABLE_BASS
-    if (!bass_loadso())
-        die("failed to load libbass.so");
-#endif
-    if (argc <= 1) 
-        die(HELP_MESSAGE);
-    
-    char c = 0;
-    while ((c = getopt(argc, argv, "hro:-:")) != -1) {
-        switch (c) {
-        default:
-        case '?':
-            die(HELP_MESSAGE);
-        case 'h':
-            puts(HELP_MESSAGE);
-            return EXIT_SUCCESS;
-        case 'r':
-            analyze = false;
-            break;
-        case 'o':
-            if (!strcmp(optarg, "stdout")) {
-                output = stdout;
-                analyze = false;
-            } else {
-                output = mwav_open_writer(optarg, 2, SAMPLERATE, 2);
-            }
-            break;
-        case '-':   // backwards compatible flag with 3.x, deprecated
-            if (!strcmp(optarg, "no-replaygain"))
-                analyze = false;
-            else
-                die(HELP_MESSAGE);
-            break;
-        };
+// the average level at the very end, songs that loop usually don't fade to silence
+static float loopiness(const float* tail, long size)
+{
+    double accu = 0;
+    for (long i = 0; i < size; i++)
+        accu += fabsf(tail[i]);
+    return accu / size;
+}
+
+// replaygain has filter tables from 8 to 96 khz, but only these give the same gain as 44.1 khz.
+// a 1 khz sine reads about a decibel louder at 96 khz and quieter at 16 khz, 88.2 khz is broken
+static bool native_gain_rate(int samplerate)
+{
+    return samplerate == 32000 || samplerate == 44100 || samplerate == 48000;
+}
+
+// per worker state, the result of a file is collected in out
+struct scan {
+    bool                analyze;
+    bool                fast;               // length from the container if possible
+    bool                json;
+    FILE*               output;
+    struct scan_index*  index;              // shared by all workers
+    struct buffer       out;
+};
+
+// input paths are handed to the workers one at a time
+static pthread_mutex_t  input_lock  = PTHREAD_MUTEX_INITIALIZER;
+static char**           input_args  = NULL;
+static int              input_count = 0;
+static bool             input_stdin = false;
+static DIR*             dirs[MAX_DEPTH];
+static char             dir_path[PATH_MAX];
+static int              dir_depth   = 0;
+
+static void append(struct buffer* b, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    long pos = b->size;
+    buffer_resize(b, pos + len + 1);
+    va_start(args, fmt);
+    vsnprintf((char*)b->data + pos, len + 1, fmt, args);
+    va_end(args);
+    b->size = pos + len;
+}
+
+// text is key:value per line, json is a single object per file
+static void put(struct scan* sc, const char* key, const char* value, bool quote)
+{
+    if (!sc->json) {
+        append(&sc->out, "%s:%s\n", key, value);
+        return;
+    }
+    append(&sc->out, "%s\"%s\":", sc->out.size ? "," : "{", key);
+    if (!quote) {
+        append(&sc->out, "%s", value);
+        return;
+    }
+    append(&sc->out, "\"");
+    for (const unsigned char* c = (const unsigned char*)value; *c; c++) {
+        if (*c == '"' || *c == '\\')
+            append(&sc->out, "\\%c", *c);
+        else if (*c < 0x20)
+            append(&sc->out, "\\u%04x", *c);
+        else
+            append(&sc->out, "%c", *c);
     }
-    path = argv[optind];
+    append(&sc->out, "\"");
+}
 
-#ifdef ENABLE_BASS
-    loaded = bass_load(&decoder, path, "bass_prescan=true", SAMPLERATE);
-#endif
-    if (!loaded)
-        loaded = ff_load(&decoder, path);
+static void put_str(struct scan* sc, const char* key, const char* value)
+{
+    put(sc, key, value, true);
+}
+
+static void put_float(struct scan* sc, const char* key, double value)
+{
+    char str[64] = "null";
+    if (!sc->json || isfinite(value))
+        snprintf(str, sizeof str, "%f", value);
+    put(sc, key, str, false);
+}
+
+static void put_int(struct scan* sc, const char* key, long value)
+{
+    char str[32] = {0};
+    snprintf(str, sizeof str, "%ld", value);
+    put(sc, key, str, false);
+}
+
+static void print_result(struct scan* sc, const char* path, const struct scan_result* r)
+{
+    if (sc->json)
+        put_str(sc, "path", path);
+
+    const char* keys[] = {"artist", "title", "album", "track"};
+    const char* values[] = {r->artist, r->title, r->album, r->track};
+    for (int i = 0; i < COUNT(keys); i++)
+        if (values[i])
+            put_str(sc, keys[i], values[i]);
+
+    put_str(sc, "type", r->type ? r->type : "unknown");
+    put_float(sc, "length", r->length);
+    if (!isnan(r->replaygain))
+        put_float(sc, "replaygain", r->replaygain);
+    if (!isnan(r->loopiness))
+        put_float(sc, "loopiness", r->loopiness);
+    if (!isnan(r->bitrate))
+        put_float(sc, "bitrate", r->bitrate);
+    if (r->samplerate)
+        put_int(sc, "samplerate", r->samplerate);
+    if (r->channels)
+        put_int(sc, "channels", r->channels);
+}
+
+// decodes the file, the strings in <r> must be freed. returns an error message or NULL
+static const char* scan_file(struct scan* sc, const char* path, struct scan_result* r)
+{
+    const char*         error       = NULL;
+    bool                analyze     = sc->analyze;
+    FILE*               output      = sc->output;
+    struct info         info        = {0};
+    struct decoder      decoder     = {0};
+    void*               resampler   = NULL;
+    struct rg_context*  ctx         = NULL;
+    float*              tail        = NULL;
+    struct stream       stream0     = {{0}};
+    struct stream       stream1     = {{0}};
+    struct stream*      stream      = &stream0;
+
+    if (!probe_load(&decoder, path, NULL, SAMPLERATE))
+        return "unknown format";
 
-    if (!loaded) 
-        die("unknown format");
-        
     decoder.info(&decoder, &info);
 
-    if (info.samplerate <= 0) 
-        die("bad samplerate");
+    if (info.samplerate <= 0) {
+        error = "bad samplerate";
+        goto cleanup;
+    }
 
-    if (info.channels < 1 || info.channels > 2) 
-        die("bad channel number");
+    if (info.channels < 1 || info.channels > 2) {
+        error = "bad channel number";
+        goto cleanup;
+    }
     
-    if ((analyze || output) && info.samplerate != SAMPLERATE) {
+    // replaygain has filters for the common rates, others are resampled like the wav output
+    if (analyze && native_gain_rate(info.samplerate))
+        ctx = rg_new(info.samplerate, RG_FLOAT32, info.channels, false);
+    bool native_gain = ctx != NULL;
+    if (analyze && !native_gain)
+        ctx = rg_new(SAMPLERATE, RG_FLOAT32, info.channels, false);
+
+    if ((output || (analyze && !native_gain)) && info.samplerate != SAMPLERATE) {
         resampler = fx_resample_init(info.channels, info.samplerate, SAMPLERATE);
-        if (!resampler)
-            die("failed to init resampler");      
+        if (!resampler) {
+            error = "failed to init resampler";
+            goto cleanup;
+        }
         stream = &stream1; 
     }
+    struct stream* gain_stream = native_gain ? &stream0 : stream;
 
-    struct rg_context* ctx = rg_new(SAMPLERATE, RG_FLOAT32, info.channels, false);
+    long tail_size = MAX(1, info.samplerate / TAIL_LENGTH);
+    long tail_pos = 0;
+    if (info.flags & INFO_MOD)
+        tail = calloc(tail_size, sizeof (float));
 
     // avcodec is unreliable when it comes to length, so the only way to be 
-    // absolutely accurate is to decode the whole stream
+    // absolutely accurate is to decode the whole stream. unless the container knows
     long frames = 0;
-    if (analyze || output || (info.flags & INFO_FFMPEG)) {
+    bool counted = false;
+    if (sc->fast && !analyze && !output && (info.flags & INFO_FFMPEG) && (info.flags & INFO_SEEKABLE)) {
+        // a header that disagrees with ffmpeg's estimate by more than a second is suspect
+        frames = probe_length(path, info.samplerate);
+        if (frames < 0 || labs(frames - info.frames) > info.samplerate)
+            frames = ff_count_frames(&decoder);
+        counted = frames >= 0;
+        frames = MAX(0, frames);
+        if (frames > MAX_LENGTH * info.samplerate) {
+            error = "exceeded maxium length";
+            goto cleanup;
+        }
+    }
+    if (analyze || output || ((info.flags & INFO_FFMPEG) && !counted)) {
         while (!stream->end_of_stream) {
             decoder.decode(&decoder, &stream0, SAMPLERATE);
             frames += stream0.frames;
-            if (frames > MAX_LENGTH * info.samplerate) 
-                die("exceeded maxium length");
+            if (frames > MAX_LENGTH * info.samplerate) {
+                error = "exceeded maxium length";
+                goto cleanup;
+            }
+            if (tail)
+                keep_tail(tail, tail_size, &tail_pos, &stream0);
 
             if (resampler)
                 fx_resample(resampler, &stream0, &stream1);
@@ -198,51 +338,269 @@ int main(int argc, char** argv)
             // there is a strange bug in the replaygain code that can cause it to report the wrong
             // value if the input buffer has an odd lenght, until the root of the cause is found,
             // this will have to do :(
-            float* buff[2] = {stream->buffer[0], stream->buffer[1]};
+            struct stream even = {{0}};
+            stream_view(&even, gain_stream, 0, gain_stream->frames & -2);
             if (analyze) 
-                rg_analyze(ctx, buff, stream->frames & -2);
+                rg_analyze(ctx, even.buffer, even.frames);
 
             if (output)
                 write_wav(output, stream);
         }
+    } else if (tail && (info.flags & INFO_SEEKABLE)) {
+        // nothing else needs the audio, so only the end is decoded
+        decoder.seek(&decoder, info.frames - tail_size);
+        while (!stream0.end_of_stream) {
+            decoder.decode(&decoder, &stream0, tail_size);
+            keep_tail(tail, tail_size, &tail_pos, &stream0);
+        }
     }
 
-    if (output == stdout)
-        return EXIT_SUCCESS;
-    if (output)
-        mwav_close_writer(output);
-
-    char* str = NULL;
-    str = decoder.metadata(&decoder, "artist");
-    if (str)
-        printf("artist:%s\n", str);
-        
-    str = decoder.metadata(&decoder, "title");
-    if (str)
-        printf("title:%s\n", str);
-        
-    printf("type:%s\n", info.codec);
+    r->artist   = decoder.metadata(&decoder, "artist");
+    r->title    = decoder.metadata(&decoder, "title");
+    r->album    = decoder.metadata(&decoder, "album");
+    r->track    = decoder.metadata(&decoder, "track");
+    r->type     = util_strdup(info.codec);
     
     // ffmpeg's length is not reliable
-    float duration = (float)((info.flags & INFO_FFMPEG) ? frames : info.frames) / info.samplerate;
-    printf("length:%f\n", duration);
+    r->length = (float)((info.flags & INFO_FFMPEG) ? frames : info.frames) / info.samplerate;
     
     if (analyze)
-        printf("replaygain:%f\n", rg_title_gain(ctx));
+        r->replaygain = rg_title_gain(ctx);
 
-#ifdef ENABLE_BASS
-    if ((info.flags & INFO_BASS) && (info.flags & INFO_MOD))
-        printf("loopiness:%f\n", bass_loopiness(path));
-#endif
+    if (tail)
+        r->loopiness = loopiness(tail, tail_size);
 
     if (info.bitrate)
-        printf("bitrate:%f\n", info.bitrate);
+        r->bitrate = info.bitrate;
     else if (info.flags & INFO_FFMPEG)
-        printf("bitrate:%f\n", fake_bitrate(path, frames / info.samplerate));
+        r->bitrate = fake_bitrate(path, frames / info.samplerate);
 
-    if (!(info.flags & INFO_MOD))
-        printf("samplerate:%d\n", info.samplerate);
+    if (!(info.flags & INFO_MOD)) {
+        r->samplerate = info.samplerate;
+        r->channels = info.channels;
+    }
+
+cleanup:
+    decoder.free(&decoder);
+    if (resampler)
+        fx_resample_free(resampler);
+    if (ctx)
+        rg_free(ctx);
+    stream_free(&stream0);
+    stream_free(&stream1);
+    free(tail);
+    return error;
+}
+
+static bool is_dir(const char* path)
+{
+    struct stat st = {0};
+    return !stat(path, &st) && S_ISDIR(st.st_mode);
+}
+
+static void free_result(struct scan_result* r)
+{
+    free((char*)r->artist);
+    free((char*)r->title);
+    free((char*)r->album);
+    free((char*)r->track);
+    free((char*)r->type);
+}
+
+// puts the result for <path> into sc->out, from the index if possible, returns an error or NULL
+static const char* scan_path(struct scan* sc, const char* path)
+{
+    struct scan_result r = {NULL, NULL, NULL, NULL, NULL, 0, NAN, NAN, NAN, 0, 0};
+    struct index_key key = {-1, 0, 0};
+    sc->out.size = 0;
+    if (sc->index && !sc->output && index_lookup(sc->index, path, &key, &r, sc->analyze)) {
+        print_result(sc, path, &r);
+        return NULL;
+    }
+
+    const char* error = scan_file(sc, path, &r);
+    if (!error && sc->output != stdout)
+        print_result(sc, path, &r);
+    if (!error && sc->index)
+        index_add(sc->index, path, &key, &r);
+    free_result(&r);
+    return error;
+}
+
+// true if path is a directory, it is then walked by next_path
+static bool enter_dir(const char* path)
+{
+    if (!is_dir(path))
+        return false;
+    DIR* dir = dir_depth < MAX_DEPTH ? opendir(path) : NULL;
+    if (dir) {
+        dirs[dir_depth++] = dir;
+        snprintf(dir_path, sizeof dir_path, "%s", path);
+    }
+    return true;
+}
+
+// next file from the directories, stdin or command line, in that order
+static bool next_path(char* path, int size)
+{
+    bool found = false;
+    pthread_mutex_lock(&input_lock);
+    while (!found) {
+        if (dir_depth > 0) {
+            struct dirent* entry = readdir(dirs[dir_depth - 1]);
+            if (!entry) {
+                closedir(dirs[--dir_depth]);
+                char* slash = strrchr(dir_path, '/');
+                if (slash)
+                    *slash = 0;
+                continue;
+            }
+            if (entry->d_name[0] == '.')    // also skips hidden files
+                continue;
+            snprintf(path, size, "%s/%s", dir_path, entry->d_name);
+            found = !enter_dir(path) && util_isfile(path);
+        } else if (input_stdin) {
+            if (!fgets(path, size, stdin)) {
+                input_stdin = false;
+                continue;
+            }
+            path[strcspn(path, "\r\n")] = 0;
+            found = *path && !enter_dir(path);
+        } else if (input_count > 0) {
+            snprintf(path, size, "%s", *input_args);
+            input_args++;
+            input_count--;
+            if (!strcmp(path, "-"))
+                input_stdin = true;
+            else
+                found = !enter_dir(path);
+        } else {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&input_lock);
+    return found;
+}
+
+static void* scan_worker(void* arg)
+{
+    struct scan sc = *(struct scan*)arg;
+    char path[PATH_MAX] = {0};
+    while (next_path(path, sizeof path)) {
+        const char* error = scan_path(&sc, path);
+        if (error) {
+            sc.out.size = 0;
+            put_str(&sc, "path", path);
+            put_str(&sc, "error", error);
+        }
+        append(&sc.out, "}\n");
+        // one call per line, so lines of different workers don't mix
+        flockfile(stdout);
+        fputs(sc.out.data, stdout);
+        fflush(stdout);
+        funlockfile(stdout);
+    }
+    buffer_free(&sc.out);
+    return NULL;
+}
+
+int main(int argc, char** argv)
+{
+    struct scan     sc          = {0};
+    int             jobs        = 0;
+    int             threads     = -1;
+
+    sc.analyze = true;
+
+#ifdef ENABLE_BASS
+    if (!bass_loadso())
+        die("failed to load libbass.so");
+#endif
+    if (argc <= 1) 
+        die(HELP_MESSAGE);
+    fx_init();
     
+    char c = 0;
+    while ((c = getopt(argc, argv, "hrfi:j:t:o:-:")) != -1) {
+        switch (c) {
+        default:
+        case '?':
+            die(HELP_MESSAGE);
+        case 'h':
+            puts(HELP_MESSAGE);
+            return EXIT_SUCCESS;
+        case 'r':
+            sc.analyze = false;
+            break;
+        case 'f':
+            sc.fast = true;
+            break;
+        case 'i':
+            sc.index = index_open(optarg);
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'o':
+            if (!strcmp(optarg, "stdout")) {
+                sc.output = stdout;
+                sc.analyze = false;
+            } else {
+                sc.output = mwav_open_writer(optarg, 2, SAMPLERATE, 2);
+            }
+            break;
+        case '-':   // --fast, and --no-replaygain which is from 3.x and deprecated
+            if (!strcmp(optarg, "no-replaygain"))
+                sc.analyze = false;
+            else if (!strcmp(optarg, "fast"))
+                sc.fast = true;
+            else
+                die(HELP_MESSAGE);
+            break;
+        };
+    }
+    if (optind >= argc)
+        die(HELP_MESSAGE);
+
+    const char* path = argv[optind];
+    if (optind + 1 == argc && strcmp(path, "-") && !is_dir(path)) {
+        ff_set_threads(MAX(0, threads));
+        const char* error = scan_path(&sc, path);
+        if (sc.index)
+            index_save(sc.index);
+        index_close(sc.index);
+        if (sc.output && sc.output != stdout)
+            mwav_close_writer(sc.output);
+        if (error)
+            die(error);
+        if (sc.out.data)
+            fputs(sc.out.data, stdout);
+        buffer_free(&sc.out);
+        return EXIT_SUCCESS;
+    }
+
+    // batch mode, each worker has its own decoder, resampler and replaygain context
+    if (sc.output)
+        die("output only works with a single file");
+    sc.json = true;
+    ff_set_threads(threads < 0 ? 1 : threads);
+    input_args = argv + optind;
+    input_count = argc - optind;
+    if (jobs <= 0)
+        jobs = MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+
+    pthread_t* workers = calloc(jobs, sizeof (pthread_t));
+    for (int i = 0; i < jobs; i++)
+        if (pthread_create(&workers[i], NULL, scan_worker, &sc))
+            die("failed to start worker");
+    for (int i = 0; i < jobs; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    if (sc.index)
+        index_save(sc.index);
+    index_close(sc.index);
     return EXIT_SUCCESS;
 }
-
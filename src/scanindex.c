@@ -0,0 +1,403 @@
+/*
+*   demosauce - fancy icecast source client
+*
+*   this source is published under the GPLv3 license.
+*   http://www.gnu.org/licenses/gpl.txt
+*   also, this is beerware! you are strongly encouraged to invite the
+*   authors of this software to a beer when you happen to meet them.
+*   copyright MMXIII by maep
+*/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "log.h"
+#include "scanindex.h"
+
+#define INDEX_MAGIC     "dsindex"
+#define INDEX_VERSION   1
+#define BYTE_ORDER_MARK 0x01020304          // the file is in native byte order
+#define HASH_BLOCK      65536               // bytes from the start and end that are hashed
+#define FNV_OFFSET      0xcbf29ce484222325ull
+#define FNV_PRIME       0x100000001b3ull
+
+enum {KEY_PATH, KEY_ARTIST, KEY_TITLE, KEY_ALBUM, KEY_TRACK, KEY_TYPE, STRING_COUNT};
+enum {STATE_UNKNOWN, STATE_KEEP, STATE_DROP};
+
+// the file is the header, entries sorted by path hash, refs sorted by content hash and strings
+struct index_header {
+    char                magic[8];
+    uint32_t            version;
+    uint32_t            byte_order;
+    uint32_t            entry_size;         // catches layout changes
+    uint32_t            count;
+    uint32_t            strings_size;
+    uint32_t            reserved;
+};
+
+struct index_entry {
+    uint64_t            path_hash;
+    struct index_key    key;
+    uint32_t            strings[STRING_COUNT];  // offsets into the strings, 0 is ""
+    float               length;
+    float               replaygain;
+    float               loopiness;
+    float               bitrate;
+    int32_t             samplerate;
+    int32_t             channels;
+};
+
+struct index_ref {
+    uint64_t            hash;
+    uint32_t            entry;
+    uint32_t            reserved;
+};
+
+struct scan_index {
+    char*                       path;
+    const void*                 map;
+    long                        map_size;
+    const struct index_entry*   entries;
+    const struct index_ref*     refs;
+    const char*                 strings;
+    long                        count;
+    long                        strings_size;
+    uint8_t*                    state;          // per mapped entry, what happens on save
+    pthread_mutex_t             lock;           // for the added entries
+    struct index_entry*         added;
+    long                        added_count;
+    long                        added_max;
+    struct buffer               added_strings;
+};
+
+static uint64_t fnv1a(uint64_t hash, const void* data, long size)
+{
+    const uint8_t* p = data;
+    for (long i = 0; i < size; i++)
+        hash = (hash ^ p[i]) * FNV_PRIME;
+    return hash;
+}
+
+static uint64_t path_hash(const char* path)
+{
+    return fnv1a(FNV_OFFSET, path, strlen(path));
+}
+
+// hashing a whole library would take as long as decoding it, so it's just the size
+// and both ends of the file, where the headers and tags are
+static uint64_t content_hash(const char* path, int64_t size)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return 0;
+    uint8_t* buf = malloc(HASH_BLOCK);
+    uint64_t hash = fnv1a(FNV_OFFSET, &size, sizeof size);
+    hash = fnv1a(hash, buf, fread(buf, 1, HASH_BLOCK, f));
+    if (size > HASH_BLOCK && !fseek(f, MAX(HASH_BLOCK, size - HASH_BLOCK), SEEK_SET))
+        hash = fnv1a(hash, buf, fread(buf, 1, HASH_BLOCK, f));
+    free(buf);
+    fclose(f);
+    return hash ? hash : 1;     // 0 means not computed
+}
+
+static const char* string(const struct scan_index* idx, uint32_t offset)
+{
+    return offset < idx->strings_size ? idx->strings + offset : "";
+}
+
+// appends str with its terminator and returns the offset, grows by doubling
+static uint32_t add_string(struct buffer* b, const char* str)
+{
+    if (!str || !*str)
+        return 0;
+    long size = b->size ? b->size : 1;   // offset 0 is the empty string
+    long len = strlen(str) + 1;
+    if (size + len > b->max_size) {
+        buffer_resize(b, MAX(size + len, b->max_size * 2));
+        ((char*)b->data)[0] = 0;
+    }
+    memcpy((char*)b->data + size, str, len);
+    b->size = size + len;
+    return size;
+}
+
+static bool check_header(struct scan_index* idx)
+{
+    const struct index_header* h = idx->map;
+    if (idx->map_size < (long)sizeof *h || memcmp(h->magic, INDEX_MAGIC, sizeof h->magic) ||
+        h->version != INDEX_VERSION || h->byte_order != BYTE_ORDER_MARK ||
+        h->entry_size != sizeof (struct index_entry) || !h->strings_size)
+        return false;
+    long entries_size = (long)h->count * sizeof (struct index_entry);
+    long refs_size = (long)h->count * sizeof (struct index_ref);
+    if ((long)sizeof *h + entries_size + refs_size + h->strings_size != idx->map_size)
+        return false;
+    idx->entries        = (const struct index_entry*)(h + 1);
+    idx->refs           = (const struct index_ref*)(idx->entries + h->count);
+    idx->strings        = (const char*)(idx->refs + h->count);
+    idx->count          = h->count;
+    idx->strings_size   = h->strings_size;
+    return !idx->strings[idx->strings_size - 1];
+}
+
+struct scan_index* index_open(const char* path)
+{
+    struct scan_index* idx = calloc(1, sizeof *idx);
+    idx->path = util_strdup(path);
+    pthread_mutex_init(&idx->lock, NULL);
+    idx->map = util_map(path, &idx->map_size);
+    if (idx->map && !check_header(idx)) {
+        LOG_WARN("[scanindex] ignoring invalid index %s", path);
+        util_unmap(idx->map, idx->map_size);
+        idx->map = NULL;
+        idx->count = 0;
+    }
+    idx->state = calloc(MAX(1, idx->count), 1);
+    LOG_INFO("[scanindex] %s has %ld entries", path, idx->count);
+    return idx;
+}
+
+// returns the mapped entry for path or -1
+static long find_path(const struct scan_index* idx, const char* path, uint64_t hash)
+{
+    long lo = 0, hi = idx->count;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (idx->entries[mid].path_hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (long i = lo; i < idx->count && idx->entries[i].path_hash == hash; i++)
+        if (!strcmp(string(idx, idx->entries[i].strings[KEY_PATH]), path))
+            return i;
+    return -1;
+}
+
+// returns the mapped entry with the same content or -1
+static long find_content(const struct scan_index* idx, const struct index_key* key)
+{
+    long lo = 0, hi = idx->count;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (idx->refs[mid].hash < key->hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (long i = lo; i < idx->count && idx->refs[i].hash == key->hash; i++) {
+        long entry = idx->refs[i].entry;
+        if (entry < idx->count && idx->entries[entry].key.size == key->size)
+            return entry;
+    }
+    return -1;
+}
+
+static void read_entry(const struct scan_index* idx, long i, struct scan_result* r)
+{
+    const struct index_entry* e = idx->entries + i;
+    const char** strings[STRING_COUNT] = {NULL, &r->artist, &r->title, &r->album, &r->track, &r->type};
+    for (int k = KEY_ARTIST; k < STRING_COUNT; k++) {
+        const char* str = string(idx, e->strings[k]);
+        *strings[k] = *str ? str : NULL;
+    }
+    r->length       = e->length;
+    r->replaygain   = e->replaygain;
+    r->loopiness    = e->loopiness;
+    r->bitrate      = e->bitrate;
+    r->samplerate   = e->samplerate;
+    r->channels     = e->channels;
+}
+
+static void set_state(struct scan_index* idx, long i, uint8_t state)
+{
+    __atomic_store_n(&idx->state[i], state, __ATOMIC_RELAXED);
+}
+
+bool index_lookup(struct scan_index* idx, const char* path, struct index_key* key,
+    struct scan_result* result, bool need_gain)
+{
+    struct stat st = {0};
+    memset(key, 0, sizeof *key);
+    key->size = -1;
+    if (stat(path, &st) || !S_ISREG(st.st_mode))
+        return false;
+    key->size = st.st_size;
+    key->mtime = st.st_mtime;
+
+    long i = find_path(idx, path, path_hash(path));
+    if (i >= 0 && need_gain && isnan(idx->entries[i].replaygain))
+        return false;
+    if (i >= 0 && idx->entries[i].key.size == key->size && idx->entries[i].key.mtime == key->mtime) {
+        key->hash = idx->entries[i].key.hash;
+        set_state(idx, i, STATE_KEEP);
+        read_entry(idx, i, result);
+        return true;
+    }
+
+    // moved, renamed or touched files keep their content
+    key->hash = content_hash(path, key->size);
+    i = find_content(idx, key);
+    if (i < 0 || (need_gain && isnan(idx->entries[i].replaygain)))
+        return false;
+    read_entry(idx, i, result);
+    index_add(idx, path, key, result);
+    LOG_DEBUG("[scanindex] %s is %s", path, string(idx, idx->entries[i].strings[KEY_PATH]));
+    return true;
+}
+
+void index_add(struct scan_index* idx, const char* path, struct index_key* key,
+    const struct scan_result* result)
+{
+    if (key->size < 0)
+        return;
+    if (!key->hash)
+        key->hash = content_hash(path, key->size);
+
+    struct index_entry e = {0};
+    e.path_hash     = path_hash(path);
+    e.key           = *key;
+    e.length        = result->length;
+    e.replaygain    = result->replaygain;
+    e.loopiness     = result->loopiness;
+    e.bitrate       = result->bitrate;
+    e.samplerate    = result->samplerate;
+    e.channels      = result->channels;
+
+    long old = find_path(idx, path, e.path_hash);
+    if (old >= 0)
+        set_state(idx, old, STATE_DROP);
+
+    pthread_mutex_lock(&idx->lock);
+    const char* strings[STRING_COUNT] = {path, result->artist, result->title, result->album,
+        result->track, result->type};
+    for (int k = 0; k < STRING_COUNT; k++)
+        e.strings[k] = add_string(&idx->added_strings, strings[k]);
+    if (idx->added_count == idx->added_max) {
+        idx->added_max = MAX(64, idx->added_max * 2);
+        idx->added = realloc(idx->added, idx->added_max * sizeof *idx->added);
+    }
+    idx->added[idx->added_count++] = e;
+    pthread_mutex_unlock(&idx->lock);
+}
+
+// copies an entry into the new index with its strings. offsets past <strings_size> come
+// from a corrupt index and are dropped, the table is known to end with a terminator
+static void copy_entry(struct index_entry* out, struct buffer* out_strings,
+    const struct index_entry* e, const char* strings, long strings_size)
+{
+    *out = *e;
+    for (int k = 0; k < STRING_COUNT; k++) {
+        uint32_t offset = e->strings[k];
+        out->strings[k] = offset && offset < strings_size ? add_string(out_strings, strings + offset) : 0;
+    }
+}
+
+static int cmp_entry(const void* a, const void* b)
+{
+    uint64_t ha = ((const struct index_entry*)a)->path_hash;
+    uint64_t hb = ((const struct index_entry*)b)->path_hash;
+    return (ha > hb) - (ha < hb);
+}
+
+static int cmp_ref(const void* a, const void* b)
+{
+    uint64_t ha = ((const struct index_ref*)a)->hash;
+    uint64_t hb = ((const struct index_ref*)b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+// a path that was added twice is only kept once
+static long remove_duplicates(struct index_entry* entries, long count, const char* strings)
+{
+    long n = 0;
+    for (long i = 0; i < count; i++) {
+        bool dup = false;
+        for (long k = n - 1; k >= 0 && entries[k].path_hash == entries[i].path_hash && !dup; k--)
+            dup = !strcmp(strings + entries[k].strings[KEY_PATH], strings + entries[i].strings[KEY_PATH]);
+        if (!dup)
+            entries[n++] = entries[i];
+    }
+    return n;
+}
+
+static bool write_index(const char* path, const struct index_entry* entries,
+    const struct index_ref* refs, long count, const struct buffer* strings)
+{
+    struct index_header h = {INDEX_MAGIC, INDEX_VERSION, BYTE_ORDER_MARK,
+        sizeof (struct index_entry), count, strings->size, 0};
+    FILE* f = fopen(path, "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(&h, sizeof h, 1, f) == 1 &&
+        fwrite(entries, sizeof *entries, count, f) == (size_t)count &&
+        fwrite(refs, sizeof *refs, count, f) == (size_t)count &&
+        fwrite(strings->data, 1, strings->size, f) == (size_t)strings->size;
+    return !fclose(f) && ok;
+}
+
+bool index_save(struct scan_index* idx)
+{
+    struct buffer strings = {0};
+    buffer_resize(&strings, 1);     // the empty string at offset 0
+    ((char*)strings.data)[0] = 0;
+
+    long count = 0;
+    struct index_entry* entries = malloc(MAX(1, idx->count + idx->added_count) * sizeof *entries);
+    for (long i = 0; i < idx->count; i++) {
+        const struct index_entry* e = idx->entries + i;
+        bool keep = idx->state[i] == STATE_KEEP;
+        if (idx->state[i] == STATE_UNKNOWN) {
+            // not part of this scan, still good if the file didn't change
+            struct stat st = {0};
+            keep = !stat(string(idx, e->strings[KEY_PATH]), &st) && st.st_size == e->key.size &&
+                st.st_mtime == e->key.mtime;
+        }
+        if (keep)
+            copy_entry(entries + count++, &strings, e, idx->strings, idx->strings_size);
+    }
+    for (long i = 0; i < idx->added_count; i++)
+        copy_entry(entries + count++, &strings, idx->added + i, idx->added_strings.data,
+            idx->added_strings.size);
+
+    qsort(entries, count, sizeof *entries, cmp_entry);
+    count = remove_duplicates(entries, count, strings.data);
+    struct index_ref* refs = malloc(MAX(1, count) * sizeof *refs);
+    for (long i = 0; i < count; i++)
+        refs[i] = (struct index_ref){entries[i].key.hash, i, 0};
+    qsort(refs, count, sizeof *refs, cmp_ref);
+
+    // written next to the old one and renamed, so the mapped file stays intact
+    char* tmp_path = util_malloc(strlen(idx->path) + 5, MEM_STRING);
+    sprintf(tmp_path, "%s.tmp", idx->path);
+    bool ok = strings.size <= UINT32_MAX && count <= UINT32_MAX &&
+        write_index(tmp_path, entries, refs, count, &strings) && !rename(tmp_path, idx->path);
+    if (ok)
+        LOG_INFO("[scanindex] saved %ld entries to %s", count, idx->path);
+    else
+        LOG_ERROR("[scanindex] failed to write %s", idx->path);
+    remove(tmp_path);
+    free(tmp_path);
+    free(entries);
+    free(refs);
+    buffer_free(&strings);
+    return ok;
+}
+
+void index_close(struct scan_index* idx)
+{
+    if (!idx)
+        return;
+    util_unmap(idx->map, idx->map_size);
+    pthread_mutex_destroy(&idx->lock);
+    buffer_free(&idx->added_strings);
+    free(idx->added);
+    free(idx->state);
+    free(idx->path);
+    free(idx);
+}
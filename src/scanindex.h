@@ -0,0 +1,67 @@
+/*
+*   demosauce - fancy icecast source client
+*
+*   this source is published under the GPLv3 license.
+*   http://www.gnu.org/licenses/gpl.txt
+*   also, this is beerware! you are strongly encouraged to invite the
+*   authors of this software to a beer when you happen to meet them.
+*   copyright MMXIII by maep
+*/
+
+#ifndef SCANINDEX_H
+#define SCANINDEX_H
+
+#include <stdint.h>
+#include "util.h"
+
+// what scan found out about a file. unknown strings are NULL, numbers NAN or 0
+struct scan_result {
+    const char* artist;
+    const char* title;
+    const char* album;
+    const char* track;
+    const char* type;
+    float       length;
+    float       replaygain;
+    float       loopiness;
+    float       bitrate;
+    int         samplerate;
+    int         channels;
+};
+
+// identifies a file on disk, hash is of the first and last few kilobytes
+struct index_key {
+    int64_t     size;                   // -1 if the file doesn't exist
+    int64_t     mtime;
+    uint64_t    hash;                   // 0 until computed
+};
+
+/*  results of earlier scans, stored in a memory mapped binary file. entries are found by
+ *  path if size and modification time didn't change, or else by content hash, so moved
+ *  files aren't decoded again.
+ *  index_open
+ *      maps the index at <path>. a missing or invalid file gives an empty index.
+ *  index_lookup
+ *      fills <result> if <path> is known. the strings point into the index and stay valid
+ *      until index_close. a file found by content is added under its new path. entries
+ *      without replaygain don't count if <need_gain>. <key> is filled either way, for
+ *      index_add. thread-safe.
+ *  index_add
+ *      stores <result> for <path>. the strings are copied. thread-safe.
+ *  index_save
+ *      writes new and unchanged entries back. entries of files that disappeared or
+ *      changed without being scanned again are dropped. returns false on error.
+ *  index_close
+ *      unmaps and frees <idx>
+ */
+struct scan_index;
+
+struct scan_index*  index_open(const char* path);
+bool                index_lookup(struct scan_index* idx, const char* path, struct index_key* key,
+                        struct scan_result* result, bool need_gain);
+void                index_add(struct scan_index* idx, const char* path, struct index_key* key,
+                        const struct scan_result* result);
+bool                index_save(struct scan_index* idx);
+void                index_close(struct scan_index* idx);
+
+#endif // SCANINDEX_H
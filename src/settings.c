@@ -35,6 +35,9 @@ static const char* HELP_MESSAGE =
 SETTINGS_LIST
 #undef X
 
+struct profile  settings_profiles[MAX_PROFILES];
+int             settings_profile_count;
+
 static const char* config_file_name = "demosauce.conf";
 
 static void die(const char* msg)
@@ -81,6 +84,44 @@ exit:
     free(buf);
 }
 
+// encoder_profiles is a list of bitrate:samplerate:channels:mount, separated by space or comma.
+// without it there is one profile made from encoder_* and cast_mount settings
+static void read_profiles(void)
+{
+    struct profile* p = settings_profiles;
+    if (!settings_encoder_profiles) {
+        p->bitrate      = settings_encoder_bitrate;
+        p->samplerate   = settings_encoder_samplerate;
+        p->channels     = settings_encoder_channels;
+        p->mount        = util_strdup(settings_cast_mount);
+        settings_profile_count = 1;
+        return;
+    }
+
+    char* str = util_strdup(settings_encoder_profiles);
+    for (char* tok = strtok(str, " \t,"); tok; tok = strtok(NULL, " \t,")) {
+        char mount[256] = {0};
+        if (settings_profile_count >= MAX_PROFILES)
+            die("too many encoder_profiles");
+        p = settings_profiles + settings_profile_count++;
+        if (sscanf(tok, "%d:%d:%d:%255s", &p->bitrate, &p->samplerate, &p->channels, mount) != 4)
+            die("bad encoder_profiles, expecting bitrate:samplerate:channels:mount");
+        p->mount = util_strdup(mount);
+    }
+    free(str);
+    if (!settings_profile_count)
+        die("encoder_profiles is empty");
+}
+
+static bool lame_samplerate(int samplerate)
+{
+    const int rates[] = {8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000};
+    for (int i = 0; i < COUNT(rates); i++)
+        if (rates[i] == samplerate)
+            return true;
+    return false;
+}
+
 static void check_sanity(void)
 {
     if (settings_config_version != 34)
@@ -101,6 +142,40 @@ static void check_sanity(void)
     if (settings_cast_port < 1 || settings_cast_port > 65535) 
         die("setting cast_port out of range (1-65535)");
 
+    for (int i = 0; i < settings_profile_count; i++) {
+        struct profile* p = settings_profiles + i;
+        if (p->bitrate < 8 || p->bitrate > 320)
+            die("profile bitrate out of range (8-320)");
+        if (!lame_samplerate(p->samplerate))
+            die("profile samplerate not supported by mp3");
+        if (p->channels < 1 || p->channels > settings_encoder_channels)
+            die("profile channels out of range (1-encoder_channels)");
+        for (int j = 0; j < i; j++)
+            if (!strcmp(p->mount, settings_profiles[j].mount))
+                die("profile mounts must be unique");
+    }
+
+    if (settings_preload_seconds < 0 || settings_preload_seconds > 3600)
+        die("setting preload_seconds out of range (0-3600)");
+
+    if (settings_queue_pcm_ms < 0 || settings_queue_pcm_ms > 60000)
+        die("setting queue_pcm_ms out of range (0-60000)");
+
+    if (settings_queue_mp3_ms < 0 || settings_queue_mp3_ms > 60000)
+        die("setting queue_mp3_ms out of range (0-60000)");
+
+    if (settings_decoder_threads < 0 || settings_decoder_threads > 64)
+        die("setting decoder_threads out of range (0-64)");
+
+    if (settings_decoder_probesize < 0)
+        die("setting decoder_probesize out of range (0-)");
+
+    if (settings_decoder_analyze_ms < 0)
+        die("setting decoder_analyze_ms out of range (0-)");
+
+    if (settings_decoder_cache_kb < 0 || settings_decoder_cache_kb > 1024 * 1024)
+        die("setting decoder_cache_kb out of range (0-1048576)");
+
     if (settings_remote_port < 1 || settings_remote_port > 65535)
         die("setting rempte_port out of range (1-65535)");
 }
@@ -113,6 +188,8 @@ static void settings_free(void)
     #define X(type, key, value) FREE_##type(key)
     SETTINGS_LIST
     #undef X
+    for (int i = 0; i < settings_profile_count; i++)
+        free(settings_profiles[i].mount);
 }
 
 void settings_init(int argc, char** argv)
@@ -145,6 +222,7 @@ void settings_init(int argc, char** argv)
         }
     }
     read_config();
+    read_profiles();
     check_sanity();
     atexit(settings_free);
 }
@@ -22,6 +22,7 @@ void settings_init(int argc, char** argv);
     X(int, encoder_samplerate,  44100)          \
     X(int, encoder_bitrate,     192)            \
     X(int, encoder_channels,    2)              \
+    X(str, encoder_profiles,    NULL)           \
     X(str, cast_host,           "localhost")    \
     X(int, cast_port,           8000)           \
     X(str, cast_mount,          "stream")       \
@@ -31,6 +32,13 @@ void settings_init(int argc, char** argv);
     X(str, cast_url,            NULL)           \
     X(str, cast_genre,          NULL)           \
     X(str, cast_description,    NULL)           \
+    X(int, preload_seconds,     10)             \
+    X(int, queue_pcm_ms,        1000)           \
+    X(int, queue_mp3_ms,        1000)           \
+    X(int, decoder_threads,     1)              \
+    X(int, decoder_probesize,   0)              \
+    X(int, decoder_analyze_ms,  0)              \
+    X(int, decoder_cache_kb,    1024)           \
     X(int, remote_enable,       1)              \
     X(int, remote_port,         1911)           \
     X(str, error_title,         "server error") \
@@ -47,5 +55,18 @@ void settings_init(int argc, char** argv);
 SETTINGS_LIST
 #undef X
 
+#define MAX_PROFILES    8
+
+// one encoder and icecast mount, parsed from encoder_profiles 
+struct profile {
+    int         bitrate;
+    int         samplerate;
+    int         channels;
+    char*       mount;
+};
+
+extern struct profile   settings_profiles[MAX_PROFILES];
+extern int              settings_profile_count;
+
 #endif
 
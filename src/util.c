@@ -15,11 +15,15 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <errno.h>
 #include <assert.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include "util.h"
 #include "log.h"
@@ -28,27 +32,52 @@
 #define MEM_ALIGN       32
 #define SOCKET_BLOCK    1024
 
-void* util_malloc(size_t size)
+static const char* mem_tag_names[MEM_TAGS] = {"stream", "buffer", "queue", "string"};
+static long mem_allocs[MEM_TAGS];
+static long mem_bytes[MEM_TAGS];
+static __thread long thread_allocs;
+
+static void mem_count(int tag, size_t size)
+{
+    assert(tag >= 0 && tag < MEM_TAGS);
+    __atomic_fetch_add(&mem_allocs[tag], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&mem_bytes[tag], (long)size, __ATOMIC_RELAXED);
+    thread_allocs++;
+}
+
+void* util_malloc(size_t size, int tag)
 {
     void* ptr = NULL;
+    mem_count(tag, size);
     int err = posix_memalign(&ptr, MEM_ALIGN, size);
     return err ? NULL : ptr;
 }    
 
-void* util_realloc(void* ptr, size_t size)
+void* util_realloc(void* ptr, size_t old_size, size_t size, int tag)
 {
-    if (ptr) {
-        ptr = realloc(ptr, size);
-        if ((size_t)ptr % MEM_ALIGN != 0) {
-            void* tmp_ptr = util_malloc(size);
-            memmove(tmp_ptr, ptr, size);
-            free(ptr);
-            ptr = tmp_ptr;
-        }
-    } else {
-        ptr = util_malloc(size);
-    }
-    return ptr;
+    // realloc doesn't keep the alignment, so it would often end up allocating twice
+    void* new_ptr = util_malloc(size, tag);
+    if (ptr && new_ptr)
+        memcpy(new_ptr, ptr, MIN(old_size, size));
+    free(ptr);
+    return new_ptr;
+}
+
+int util_mem_print(char* str, int size)
+{
+    int len = 0;
+    for (int i = 0; i < MEM_TAGS && len < size; i++) 
+        len += snprintf(str + len, size - len, "mem_%s_allocs=%ld mem_%s_bytes=%ld ", mem_tag_names[i], 
+            __atomic_load_n(&mem_allocs[i], __ATOMIC_RELAXED), mem_tag_names[i], 
+            __atomic_load_n(&mem_bytes[i], __ATOMIC_RELAXED));
+    if (len < size)
+        len += snprintf(str + len, size - len, "\n");
+    return len;
+}
+
+long util_thread_allocs(void)
+{
+    return thread_allocs;
 }
 
 //-----------------------------------------------------------------------------
@@ -71,14 +100,52 @@ long util_filesize(const char* path)
     return size;
 }
 
+const void* util_map(const char* path, long* size)
+{
+    *size = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st = {0};
+    void* map = MAP_FAILED;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+    *size = st.st_size;
+    return map;
+}
+
+void util_unmap(const void* map, long size)
+{
+    if (map)
+        munmap((void*)map, size);
+}
+
+void util_sleep_ms(long ms)
+{
+    struct timespec t = {ms / 1000, (ms % 1000) * 1000000};
+    while (nanosleep(&t, &t) && errno == EINTR);
+}
+
+long util_time_ms(void)
+{
+    struct timespec t = {0};
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
 //-----------------------------------------------------------------------------
 
 char* util_strdup(const char* str)
 {
     if (!str)
         return NULL;
-    char* s = calloc(strlen(str) + 1, 1);
-    strcpy(s, str);
+    size_t size = strlen(str) + 1;
+    char* s = util_malloc(size, MEM_STRING);
+    memcpy(s, str, size);
     return s;
 }
 
@@ -131,7 +198,7 @@ static char* keyval_impl(char* out, int size, const char* heap, const char* key,
 
     if (have_key) {
         if (!out || span < size) {
-            char* value = out ? out : malloc(span + 1);
+            char* value = out ? out : util_malloc(span + 1, MEM_STRING);
             memmove(value, tmp, span);
             value[span] = 0;
             LOG_DEBUG("[keyval] '%s' = '%s'", key, value);
@@ -189,6 +256,47 @@ bool keyval_bool(const char* heap, const char* key, bool fallback)
     return strlen(tmp) ? !strcasecmp(tmp, "true") : fallback;
 }
 
+static bool keyval_has(const char* heap, const char* key)
+{
+    size_t len = strlen(key);
+    for (const char* tmp = heap; tmp && *tmp; tmp = skip_line(tmp))
+        if (!strncmp(tmp, key, len) && tmp[len] == '=')
+            return true;
+    return false;
+}
+
+void keyval_append(struct buffer* b, const char* key, const char* value, long size)
+{
+    if (!value)
+        return;
+    if (size < 0)
+        size = strlen(value);
+    const char* end = memchr(value, 0, size);    // fixed size fields are padded with zeros
+    if (end)
+        size = end - value;
+    while (size && isspace((unsigned char)*value)) {
+        value++;
+        size--;
+    }
+    while (size && isspace((unsigned char)value[size - 1]))
+        size--;
+
+    // keys are lower case, so decoders agree on them
+    char lower_key[64] = {0};
+    for (int i = 0; key[i] && i < sizeof lower_key - 1; i++)
+        lower_key[i] = tolower((unsigned char)key[i]);
+    if (!size || !*lower_key || strchr(lower_key, '=') || keyval_has(b->data, lower_key))
+        return;
+
+    long len = b->data ? strlen(b->data) : 0;
+    buffer_resize(b, len + strlen(lower_key) + size + 3);
+    char* str = (char*)b->data + len;
+    str += sprintf(str, "%s=", lower_key);
+    for (long i = 0; i < size; i++)
+        *str++ = (value[i] == '\n' || value[i] == '\r') ? ' ' : value[i];
+    strcpy(str, "\n");
+}
+
 //-----------------------------------------------------------------------------
 
 int socket_connect(const char* host, int port)
@@ -320,7 +428,7 @@ void buffer_resize(struct buffer* buf, long size)
 {
     buf->size = MAX(0, size);
     if (buf->max_size < buf->size) {
-        buf->data = util_realloc(buf->data, buf->size);
+        buf->data = util_realloc(buf->data, buf->max_size, buf->size, MEM_BUFFER);
         buf->max_size = buf->size;
         LOG_DEBUG("[buffer] %p resize to %ld bytes", buf, size);
     }
@@ -335,23 +443,49 @@ void buffer_free(struct buffer* buf)
 
 //-----------------------------------------------------------------------------
 
+// moves the samples back to the start of the allocation
+static void stream_compact(struct stream* s)
+{
+    if (!s->offset)
+        return;
+    for (int ch = 0; ch < MAX_CHANNELS; ch++) {
+        if (!s->buffer[ch])
+            continue;
+        float* base = s->buffer[ch] - s->offset;
+        memmove(base, s->buffer[ch], s->frames * sizeof (float));
+        s->buffer[ch] = base;
+    }
+    s->max_frames += s->offset;
+    s->offset = 0;
+}
+
 void stream_resize(struct stream* s, int frames, int channels)
 {
     assert(channels >= 1 && channels <= MAX_CHANNELS);
+    if (frames <= s->max_frames && channels == s->channels)
+        return;
+    assert(!s->view);
+    stream_compact(s);
     if (frames <= s->max_frames && channels == s->channels)
         return;
     if (frames > s->max_frames)
         LOG_DEBUG("[stream] %p resize to %d frames", s, frames);
+    long old_frames = s->max_frames;
     s->channels = channels;
     s->max_frames = MAX(frames, s->max_frames);
-    for (int ch = 0; ch < channels; ch++)
-        s->buffer[ch] = util_realloc(s->buffer[ch], s->max_frames * sizeof (float));
+    // unused channels are kept for the next channel change, but all buffers must share capacity
+    for (int ch = 0; ch < MAX_CHANNELS; ch++)
+        if ((ch < channels || s->buffer[ch]) && (old_frames < s->max_frames || !s->buffer[ch]))
+            s->buffer[ch] = util_realloc(s->buffer[ch], old_frames * sizeof (float), 
+                s->max_frames * sizeof (float), MEM_STREAM);
 }
 
 void stream_free(struct stream* s)
 {
-    for (int i = 0; i < MAX_CHANNELS; i++)
-        free(s->buffer[i]);
+    if (!s->view)
+        for (int i = 0; i < MAX_CHANNELS; i++)
+            if (s->buffer[i])
+                free(s->buffer[i] - s->offset);
     memset(s, 0, sizeof *s);
     LOG_DEBUG("[stream] %p free", s);
 }
@@ -360,10 +494,10 @@ void stream_append(struct stream* s, struct stream* source, int frames)
 {
     assert(source->channels >= 1 && source->channels <= MAX_CHANNELS);
     frames = CLAMP(0, frames, source->frames);
-    s->frames += frames;
-    stream_resize(s, s->frames, source->channels);
+    stream_resize(s, s->frames + frames, source->channels);
     for (int ch = 0; ch < s->channels; ch++)
-        memmove(s->buffer[ch], source->buffer[ch], frames * sizeof (float));
+        memmove(s->buffer[ch] + s->frames, source->buffer[ch], frames * sizeof (float));
+    s->frames += frames;
 }
 
 void stream_append_convert(struct stream* s, void** source, int type, int frames, int channels)
@@ -381,15 +515,87 @@ void stream_drop(struct stream* s, int frames)
 {
     frames = CLAMP(0, frames, s->frames);
     s->frames -= frames;
-    if (s->frames > 0)
-        for (int ch = 0; ch < s->channels; ch++)
-            memmove(s->buffer[ch], s->buffer[ch] + frames, s->frames * sizeof (float));
+    // rewind for free once empty, otherwise leave the gap for stream_resize to reclaim
+    long advance = s->frames ? frames : -s->offset;
+    for (int ch = 0; ch < MAX_CHANNELS; ch++)
+        if (s->buffer[ch])
+            s->buffer[ch] += advance;
+    s->offset += advance;
+    s->max_frames -= advance;
 }
 
 void stream_zero(struct stream* s, int offset, int frames)
 {
-    frames = CLAMP(0, s->max_frames - (offset + frames), frames);
+    frames = CLAMP(0, frames, s->max_frames - offset);
     for (int ch = 0; ch < s->channels; ch++)
         memset(s->buffer[ch] + offset, 0, frames * sizeof (float));
     s->frames = offset + frames;
 }
+
+void stream_view(struct stream* view, struct stream* s, int offset, int frames)
+{
+    offset = CLAMP(0, offset, s->frames);
+    frames = CLAMP(0, frames, s->frames - offset);
+    memset(view, 0, sizeof *view);
+    for (int ch = 0; ch < MAX_CHANNELS; ch++)
+        view->buffer[ch] = s->buffer[ch] ? s->buffer[ch] + offset : NULL;
+    view->frames        = frames;
+    view->max_frames    = frames;
+    view->channels      = s->channels;
+    view->end_of_stream = s->end_of_stream && offset + frames == s->frames;
+    view->view          = true;
+}
+
+//-----------------------------------------------------------------------------
+
+void queue_init(struct queue* q, long capacity, long slot_size)
+{
+    assert(capacity > 0 && slot_size > 0);
+    memset(q, 0, sizeof *q);
+    q->slots = util_malloc(capacity * slot_size, MEM_QUEUE);
+    memset(q->slots, 0, capacity * slot_size);
+    q->capacity = capacity;
+    q->slot_size = slot_size;
+    LOG_DEBUG("[queue] %p init, %ld slots of %ld bytes", q, capacity, slot_size);
+}
+
+void queue_free(struct queue* q, void (*release)(void*))
+{
+    for (long i = 0; release && i < q->capacity; i++)
+        release(q->slots + i * q->slot_size);
+    free(q->slots);
+    memset(q, 0, sizeof *q);
+    LOG_DEBUG("[queue] %p free", q);
+}
+
+void* queue_write_slot(struct queue* q)
+{
+    // head is only modified by this thread, tail must be synchronized
+    unsigned long tail = ATOMIC_LOAD(&q->tail);
+    if (q->head - tail >= q->capacity)
+        return NULL;
+    return q->slots + (q->head % q->capacity) * q->slot_size;
+}
+
+void queue_push(struct queue* q)
+{
+    ATOMIC_STORE(&q->head, q->head + 1);
+}
+
+void* queue_read_slot(struct queue* q)
+{
+    unsigned long head = ATOMIC_LOAD(&q->head);
+    if (head == q->tail)
+        return NULL;
+    return q->slots + (q->tail % q->capacity) * q->slot_size;
+}
+
+void queue_pop(struct queue* q)
+{
+    ATOMIC_STORE(&q->tail, q->tail + 1);
+}
+
+long queue_fill(struct queue* q)
+{
+    return ATOMIC_LOAD(&q->head) - ATOMIC_LOAD(&q->tail);
+}
@@ -19,6 +19,7 @@
 #define INFO_SEEKABLE   1
 #define INFO_FFMPEG     (1 << 1)
 #define INFO_BASS       (1 << 2)  
+#define INFO_OPENMPT    (1 << 3)
 #define INFO_MOD        (1 << 16)
 #define INFO_AMIGAMOD   (1 << 17)
 
@@ -37,11 +38,21 @@
 #define MAX(a, b)       ((a) > (b) ? (a) : (b))
 #define CLAMP(a, b, c)  ((b) < (a) ? (a) : (b) > (c) ? (c) : (b))
 
+// flags and counters shared between threads
+#define ATOMIC_LOAD(ptr)        __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(ptr, val)  __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+
 enum sampleformat {                 // planar formats must have odd number
     SF_INT16I       = 0,            // interleaved 16 bit int    
     SF_INT16P       = 1,            // planar 16 bit int
     SF_FLOAT32I     = 2,            // interleaved 32 bit float
-    SF_FLOAT32P     = 3             // planar 32 bit float
+    SF_FLOAT32P     = 3,            // planar 32 bit float
+    SF_INT32I       = 4,            // interleaved 32 bit int
+    SF_INT32P       = 5,            // planar 32 bit int
+    SF_FLOAT64I     = 6,            // interleaved 64 bit float
+    SF_FLOAT64P     = 7,            // planar 64 bit float
+    SF_UINT8I       = 8,            // interleaved unsigned 8 bit int
+    SF_UINT8P       = 9             // planar unsigned 8 bit int
 };
 
 struct buffer {
@@ -53,9 +64,20 @@ struct buffer {
 struct stream {
     float*      buffer[MAX_CHANNELS];   // buffer[0] left channel, buffer[1] right channel
     long        frames;                 // number of samples in the buffer, same for mono and stereo
-    long        max_frames;             // capacity of allocated buffers
+    long        max_frames;             // capacity of buffers, counted from buffer[ch]
+    long        offset;                 // frames dropped from the front, allocation is buffer[ch] - offset
     int         channels;               // 1 mono, 2 stereo
     bool        end_of_stream;          // is set when stream ended
+    bool        view;                   // buffers are borrowed from another stream
+};
+
+// bounded lock-free queue for exactly one producer and one consumer thread
+struct queue {
+    char*           slots;
+    long            slot_size;              // size of one element in bytes
+    long            capacity;               // number of elements
+    unsigned long   head;                   // written by producer only
+    unsigned long   tail;                   // written by consumer only
 };
 
 struct info {
@@ -93,9 +115,31 @@ struct decoder {
 };
 
 
-// equivalent to stdlib functions, but memory is aligned to 32 byte boundry. 
-void*   util_malloc(size_t size);
-void*   util_realloc(void* ptr, size_t size);
+// subsystems for allocation accounting
+enum mem_tag {
+    MEM_STREAM,                     // struct stream samples
+    MEM_BUFFER,                     // struct buffer
+    MEM_QUEUE,                      // queue slots
+    MEM_STRING,                     // util_strdup and keyval_str_dup
+    MEM_TAGS
+};
+
+/*  memory functions
+ *  util_malloc
+ *      equivalent to malloc, but memory is aligned to 32 byte boundry. the allocation
+ *      is counted for <tag>, one of enum mem_tag.
+ *  util_realloc
+ *      like util_malloc, copies the first <old_size> bytes of <ptr> and frees it.
+ *  util_mem_print
+ *      writes number of allocations and allocated bytes per subsystem to <str>, returns
+ *      the number of written chars like snprintf.
+ *  util_thread_allocs
+ *      returns number of allocations made by the calling thread.
+ */
+void*   util_malloc(size_t size, int tag);
+void*   util_realloc(void* ptr, size_t old_size, size_t size, int tag);
+int     util_mem_print(char* str, int size);
+long    util_thread_allocs(void);
 
 /*  misc functions
  *  util_strdup
@@ -106,11 +150,21 @@ void*   util_realloc(void* ptr, size_t size);
  *      return true if <path> is a regular file
  *  util_filesize
  *      returns size of <path> in bytes
+ *  util_map
+ *      maps the regular file <path> read-only into memory and sets <size>. returns NULL
+ *      on error or if the file is empty. release with util_unmap.
  */
 char*   util_strdup(const char* str);
 char*   util_trim(char* str);          
 bool    util_isfile(const char* path);
 long    util_filesize(const char* path);
+const void* util_map(const char* path, long* size);
+void    util_unmap(const void* map, long size);
+
+// suspend calling thread for <ms> miliseconds
+void    util_sleep_ms(long ms);
+// miliseconds of a monotonic clock, only useful for measuring intervals
+long    util_time_ms(void);
 
 /*  socket_connect
  *      opens tcp socket on <host>:<port>. returns -1 on error. close with socket_close.
@@ -138,7 +192,12 @@ void    socket_close(int socket);
  *  keyval_str_dup
  *      same as keyval_str, but the value and the fallback are put into a newly allocated
  *      string that must be freed with util_free.    
+ *  keyval_append
+ *      adds <key>=<value> to the string in <b>, used by decoders to keep their tags. <size> is
+ *      the length of <value> or -1 if it's terminated. the key is made lower case, line breaks
+ *      in the value become spaces. empty values and keys that are already set are ignored.
  */
+void    keyval_append(struct buffer* b, const char* key, const char* value, long size);
 void    keyval_str(char* outbuf, int outsize, const char* str, const char* key, const char* fallback);
 char*   keyval_str_dup(const char* str, const char* key, const char* fallback);
 long    keyval_int(const char* str, const char* key, long fallback);
@@ -162,19 +221,25 @@ void    buffer_zero(struct buffer* b);
  *      resize <stream> to hold at least <frames> frames in <channels> channels. if <frames> is
  *      smaller than s->max_frames this function has no effect, unless <channels> changes number
  *      of channels.
+ *      frames dropped from the front are reclaimed before the buffers grow. views can't be
+ *      resized.
  *  stream_free
- *      frees the buffers and set all members of <stram> to zero.
- *      stream_append
- *      append <frames> frames of <source> to <stream>. <source> will not be changed.
- *      <stream> might be increased to hold all data.
+ *      frees the buffers and set all members of <stram> to zero. views are only cleared.
+ *  stream_append
+ *      append <frames> frames of <source> to the end of <stream>. <source> will not be
+ *      changed. <stream> might be increased to hold all data.
  *  stream_append_convert
  *      append <frames> frames of <source> to <stream>. <type> must be one of the formats
  *      in enum sampleformat. source[0] holds the left channel, source[1] the right channel
  *      if applicable. if the data is interleaved only source[0] is set.
  *  stream_drop
- *      remove <frames> frames from the beginning of the <stream>.
+ *      remove <frames> frames from the beginning of the <stream>. this only advances the
+ *      buffer pointers, no samples are moved.
  *  stream_zero
  *      set <frames> frames to zero, starting with <offset> frames.
+ *  stream_view
+ *      makes <view> refer to <frames> frames of <s>, starting at <offset>, without copying.
+ *      samples can be modified in place. the view is valid until <s> is resized or freed.
  */
 void    stream_resize(struct stream* s, int frames, int channels);
 void    stream_free(struct stream* s);
@@ -182,5 +247,30 @@ void    stream_append(struct stream* s, struct stream* source, int frames);
 void    stream_append_convert(struct stream* s, void** source, int type, int frames, int channels);
 void    stream_drop(struct stream* s, int frames);
 void    stream_zero(struct stream* s, int offset, int frames);
+void    stream_view(struct stream* view, struct stream* s, int offset, int frames);
+
+/*  queue_init
+ *      initializes <q> with <capacity> zeroed elements of <slot_size> bytes. elements are
+ *      recycled, not cleared, so they can own buffers that get reused on the next round.
+ *  queue_free
+ *      calls <release> on every element (unless NULL) and frees <q>.
+ *  queue_write_slot
+ *      producer only. returns the next free element, or NULL if the queue is full.
+ *  queue_push
+ *      producer only. publishes the element returned by queue_write_slot.
+ *  queue_read_slot
+ *      consumer only. returns the oldest published element, or NULL if the queue is empty.
+ *  queue_pop
+ *      consumer only. returns the element from queue_read_slot to the producer.
+ *  queue_fill
+ *      number of published elements, can be called from any thread.
+ */
+void    queue_init(struct queue* q, long capacity, long slot_size);
+void    queue_free(struct queue* q, void (*release)(void*));
+void*   queue_write_slot(struct queue* q);
+void    queue_push(struct queue* q);
+void*   queue_read_slot(struct queue* q);
+void    queue_pop(struct queue* q);
+long    queue_fill(struct queue* q);
 
 #endif // UTIL_H
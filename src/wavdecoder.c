@@ -0,0 +1,207 @@
+/*
+*   demosauce - fancy icecast source client
+*
+*   this source is published under the GPLv3 license.
+*   http://www.gnu.org/licenses/gpl.txt
+*   also, this is beerware! you are strongly encouraged to invite the
+*   authors of this software to a beer when you happen to meet them.
+*   copyright MMXIII by maep
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "log.h"
+#include "wavdecoder.h"
+
+#define FORMAT_PCM          1
+#define FORMAT_FLOAT        3
+#define FORMAT_EXTENSIBLE   0xfffe
+
+struct wavdecoder {
+    const uint8_t*  map;
+    long            map_size;
+    const uint8_t*  data;               // first sample
+    struct buffer   buffer;             // for 24 bit and unaligned samples
+    long            frames;
+    long            current_frame;
+    int             channels;
+    int             samplerate;
+    int             bits;
+    int             frame_size;         // bytes
+    int             format;             // enum sampleformat, 24 bit is widened to SF_INT32I
+    struct buffer   tags;               // key-value string from the INFO list
+};
+
+static unsigned le16(const uint8_t* p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static unsigned long le32(const uint8_t* p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned long)p[3] << 24;
+}
+
+static void wav_decode(struct decoder* dec, struct stream* s, int frames)
+{
+    struct wavdecoder* d = dec->handle;
+    frames = CLAMP(0, d->frames - d->current_frame, frames);
+    const uint8_t* src = d->data + d->current_frame * d->frame_size;
+    void* ptr = (void*)src;
+    int sample_size = d->bits / 8;
+
+    if (d->bits == 24) {
+        int samples = frames * d->channels;
+        buffer_resize(&d->buffer, samples * sizeof (int32_t));
+        int32_t* out = d->buffer.data;
+        for (int i = 0; i < samples; i++, src += 3)
+            out[i] = (int32_t)((uint32_t)src[0] << 8 | (uint32_t)src[1] << 16 | (uint32_t)src[2] << 24);
+        ptr = out;
+    } else if ((uintptr_t)src % sample_size) {
+        buffer_resize(&d->buffer, frames * d->frame_size);
+        memcpy(d->buffer.data, src, frames * d->frame_size);
+        ptr = d->buffer.data;
+    }
+
+    s->frames = 0;
+    stream_append_convert(s, &ptr, d->format, frames, d->channels);
+    d->current_frame += frames;
+    s->end_of_stream = d->current_frame >= d->frames;
+}
+
+static void wav_seek(struct decoder* dec, long frame)
+{
+    struct wavdecoder* d = dec->handle;
+    d->current_frame = CLAMP(0, frame, d->frames);
+}
+
+static void wav_info(struct decoder* dec, struct info* info)
+{
+    struct wavdecoder* d = dec->handle;
+    memset(info, 0, sizeof *info);
+    info->codec         = "pcm";
+    info->bitrate       = (float)d->samplerate * d->frame_size * 8 / 1000;
+    info->frames        = d->frames;
+    info->channels      = d->channels;
+    info->samplerate    = d->samplerate;
+    info->flags         = INFO_SEEKABLE;
+}
+
+static char* wav_metadata(struct decoder* dec, const char* key)
+{
+    struct wavdecoder* d = dec->handle;
+    return keyval_str_dup(d->tags.data, key, NULL);
+}
+
+static void wav_free(struct decoder* dec)
+{
+    struct wavdecoder* d = dec->handle;
+    util_unmap(d->map, d->map_size);
+    buffer_free(&d->buffer);
+    buffer_free(&d->tags);
+    free(d);
+    memset(dec, 0, sizeof *dec);
+}
+
+// reads the tags of a LIST chunk of type INFO
+static void read_info(struct wavdecoder* d, const uint8_t* chunk, long size)
+{
+    static const char* keys[][2] = {
+        {"INAM", "title"}, {"IART", "artist"}, {"IPRD", "album"},
+        {"ITRK", "track"}, {"ICRD", "date"}, {"IGNR", "genre"}
+    };
+    if (size < 4 || memcmp(chunk, "INFO", 4))
+        return;
+    for (long pos = 4; pos + 8 <= size; ) {
+        const uint8_t* sub = chunk + pos;
+        long sub_size = MIN((long)le32(sub + 4), size - pos - 8);
+        for (int i = 0; i < COUNT(keys); i++)
+            if (!memcmp(sub, keys[i][0], 4))
+                keyval_append(&d->tags, keys[i][1], (const char*)sub + 8, sub_size);
+        pos += 8 + sub_size + (sub_size & 1);
+    }
+}
+
+static int sample_format(int tag, int bits)
+{
+    if (tag == FORMAT_PCM) {
+        switch (bits) {
+        case 8:     return SF_UINT8I;
+        case 16:    return SF_INT16I;
+        case 24:    // widened while decoding
+        case 32:    return SF_INT32I;
+        }
+    } else if (tag == FORMAT_FLOAT) {
+        switch (bits) {
+        case 32:    return SF_FLOAT32I;
+        case 64:    return SF_FLOAT64I;
+        }
+    }
+    return -1;
+}
+
+static bool read_header(struct wavdecoder* d)
+{
+    const uint8_t* p = d->map;
+    long size = d->map_size;
+    if (size < 12 || memcmp(p, "RIFF", 4) || memcmp(p + 8, "WAVE", 4))
+        return false;
+
+    int tag = 0;
+    long data_size = 0;
+    for (long pos = 12; pos + 8 <= size; ) {
+        const uint8_t* chunk = p + pos + 8;
+        long chunk_size = le32(p + pos + 4);
+        long avail = size - pos - 8;
+        if (!memcmp(p + pos, "fmt ", 4) && chunk_size >= 16 && chunk_size <= avail) {
+            tag             = le16(chunk);
+            d->channels     = le16(chunk + 2);
+            d->samplerate   = le32(chunk + 4);
+            d->frame_size   = le16(chunk + 12);
+            d->bits         = le16(chunk + 14);
+            if (tag == FORMAT_EXTENSIBLE && chunk_size >= 26)
+                tag = le16(chunk + 24);     // first bytes of the sub format guid
+        } else if (!memcmp(p + pos, "LIST", 4) && chunk_size <= avail) {
+            read_info(d, chunk, chunk_size);
+        } else if (!memcmp(p + pos, "data", 4) && !d->data) {
+            // streamed files may have a bogus size, the data runs until the end of file
+            d->data = chunk;
+            data_size = (chunk_size && chunk_size <= avail) ? chunk_size : avail;
+        }
+        pos += 8 + chunk_size + (chunk_size & 1);
+    }
+
+    d->format = sample_format(tag, d->bits);
+    if (!d->data || d->format < 0 || d->channels < 1 || d->channels > MAX_CHANNELS ||
+        d->samplerate <= 0 || d->frame_size != d->channels * d->bits / 8)
+        return false;
+    d->frames = data_size / d->frame_size;
+    return true;
+}
+
+bool wav_load(struct decoder* dec, const char* path)
+{
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    return false;   // samples are converted straight from the file
+#endif
+    struct wavdecoder* d = calloc(1, sizeof *d);
+    d->map = util_map(path, &d->map_size);
+    if (!d->map || !read_header(d)) {
+        LOG_DEBUG("[wavdecoder] can't decode %s", path);
+        util_unmap(d->map, d->map_size);
+        buffer_free(&d->tags);
+        free(d);
+        return false;
+    }
+
+    dec->free       = wav_free;
+    dec->seek       = wav_seek;
+    dec->info       = wav_info;
+    dec->metadata   = wav_metadata;
+    dec->decode     = wav_decode;
+    dec->handle     = d;
+
+    LOG_INFO("[wavdecoder] loaded %s", path);
+    return true;
+}
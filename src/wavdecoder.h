@@ -0,0 +1,23 @@
+/*
+*   demosauce - fancy icecast source client
+*
+*   this source is published under the GPLv3 license.
+*   http://www.gnu.org/licenses/gpl.txt
+*   also, this is beerware! you are strongly encouraged to invite the
+*   authors of this software to a beer when you happen to meet them.
+*   copyright MMXIII by maep
+*/
+
+#ifndef WAVDECODER_H
+#define WAVDECODER_H
+
+#include "util.h"
+
+/*  wav_load
+ *      opens an uncompressed wav file with 8, 16, 24, 32 bit int or 32, 64 bit float samples.
+ *      the file is memory mapped, length and seeking are exact. returns false for anything
+ *      else, which is left to ffmpeg.
+ */
+bool    wav_load(struct decoder* dec, const char* path);
+
+#endif // WAVDECODER_H
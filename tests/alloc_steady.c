@@ -0,0 +1,125 @@
+/*
+*   demosauce - fancy icecast source client
+*
+*   this source is published under the GPLv3 license.
+*   http://www.gnu.org/licenses/gpl.txt
+*   also, this is beerware! you are strongly encouraged to invite the
+*   authors of this software to a beer when you happen to meet them.
+*   copyright MMXIII by maep
+*/
+
+// runs the cast pipeline without lame and icecast: decode, effects, pcm queue, and an
+// encoder stage that reads the queue. after warmup no block may allocate, also not when
+// the file is looped by seeking
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "util.h"
+#include "effects.h"
+#include "wavdecoder.h"
+
+#define TEST_FILE   "alloc_steady.wav"
+#define SAMPLERATE  44100
+#define BLOCK       (SAMPLERATE / 10)
+#define FILE_FRAMES (SAMPLERATE * 3 + 123)      // last block of each pass is short
+#define QUEUE_SIZE  4
+#define WARMUP      (QUEUE_SIZE * 2)            // every queue slot has been used
+#define BLOCKS      100
+
+static void put_le(uint8_t* p, uint32_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        p[i] = (v >> (8 * i)) & 0xff;
+}
+
+// mono 16 bit, so the effect chain has to grow the stream to stereo
+static bool write_file(void)
+{
+    FILE* f = fopen(TEST_FILE, "wb");
+    if (!f)
+        return false;
+    uint8_t header[44] = {'R', 'I', 'F', 'F', 0, 0, 0, 0, 'W', 'A', 'V', 'E', 'f', 'm', 't', ' ',
+        16, 0, 0, 0, 1, 0, 1, 0};
+    put_le(header + 4, 36 + FILE_FRAMES * 2, 4);
+    put_le(header + 24, SAMPLERATE, 4);
+    put_le(header + 28, SAMPLERATE * 2, 4);
+    put_le(header + 32, 2, 2);
+    put_le(header + 34, 16, 2);
+    memcpy(header + 36, "data", 4);
+    put_le(header + 40, FILE_FRAMES * 2, 4);
+    fwrite(header, 1, sizeof header, f);
+    for (long i = 0; i < FILE_FRAMES; i++) {
+        uint8_t sample[2];
+        put_le(sample, (uint16_t)(i * 37), 2);
+        fwrite(sample, 1, 2, f);
+    }
+    return fclose(f) == 0;
+}
+
+static void free_slot(void* slot)
+{
+    stream_free(slot);
+}
+
+int main(void)
+{
+    if (!write_file()) {
+        puts("can't write " TEST_FILE);
+        return 1;
+    }
+    fx_init();
+    struct decoder dec = {0};
+    if (!wav_load(&dec, TEST_FILE)) {
+        puts("can't load " TEST_FILE);
+        return 1;
+    }
+
+    struct queue queue = {0};
+    queue_init(&queue, QUEUE_SIZE, sizeof (struct stream));
+    struct stream s = {0};
+    struct fx_chain fx = {{0}};
+    fx_chain_init(&fx, 2, 0.5f, FX_MIX | FX_FADE | FX_CLIP);
+    fx_fade_init(&fx.fade, 0, BLOCKS * BLOCK, 1, 0);
+    int16_t* pcm = util_malloc(BLOCK * 2 * sizeof (int16_t), MEM_BUFFER);
+
+    bool ok = true;
+    for (int i = 0; i < BLOCKS; i++) {
+        long allocs = util_thread_allocs();
+        dec.decode(&dec, &s, BLOCK);
+        if (s.end_of_stream)
+            dec.seek(&dec, 0);
+        fx_chain(&fx, &s);
+
+        struct stream* slot = queue_write_slot(&queue);
+        slot->frames = 0;
+        stream_append(slot, &s, s.frames);
+        queue_push(&queue);
+
+        // stands in for the encoder, which takes interleaved samples
+        struct stream* in = queue_read_slot(&queue);
+        for (long k = 0; k < in->frames; k++)
+            for (int ch = 0; ch < 2; ch++)
+                pcm[k * 2 + ch] = (int16_t)(in->buffer[ch][k] * 32767);
+        queue_pop(&queue);
+
+        long count = util_thread_allocs() - allocs;
+        if (i >= WARMUP && count) {
+            printf("block %d: %ld allocations\n", i, count);
+            ok = false;
+        }
+    }
+
+    char stats[512] = {0};
+    util_mem_print(stats, sizeof stats);
+    printf("%s", stats);
+
+    free(pcm);
+    queue_free(&queue, free_slot);
+    stream_free(&s);
+    dec.free(&dec);
+    remove(TEST_FILE);
+    puts(ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,163 @@
+/*
+*   demosauce - fancy icecast source client
+*
+*   this source is published under the GPLv3 license.
+*   http://www.gnu.org/licenses/gpl.txt
+*   also, this is beerware! you are strongly encouraged to invite the
+*   authors of this software to a beer when you happen to meet them.
+*   copyright MMXIII by maep
+*/
+
+// times the effect chain as separate passes and fused, with the scalar kernels and with the
+// ones fx_init picks. then
+// decodes each file given on the command line, natively and, if built with it, with ffmpeg.
+// not run by ctest, numbers depend on the machine. usage: bench [file...]
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "util.h"
+#include "effects.h"
+#include "flacdecoder.h"
+#include "wavdecoder.h"
+#ifdef HAVE_FFMPEG
+#include "ffdecoder.h"
+#endif
+
+#define SAMPLERATE  44100
+#define BLOCK       (SAMPLERATE / 10)
+#define BLOCKS      3000                    // five minutes of audio
+#define MIN_TIME    1.0                     // files are decoded repeatedly for at least this long
+
+struct chain_case {
+    const char* name;
+    int         in;
+    int         out;
+    int         flags;
+};
+
+static const struct chain_case chain_cases[] = {
+    {"stereo gain",     2, 2, 0},
+    {"stereo mix clip", 2, 2, FX_MIX | FX_CLIP},
+    {"stereo fade",     2, 2, FX_FADE | FX_CLIP},
+    {"mono to stereo",  1, 2, 0},
+    {"stereo to mono",  2, 1, 0}
+};
+
+static double now(void)
+{
+    struct timespec t = {0};
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// returns nanoseconds per frame, <fused> runs fx_chain, otherwise one call per effect
+static double time_chain(const struct chain_case* c, bool fused)
+{
+    struct stream s = {0};
+    struct fx_chain fx = {{0}};
+    fx_chain_init(&fx, c->out, 1, c->flags);
+    fx_mix_init(&fx.mix, 0.7f, 0.3f, 0.6f, 0.4f);
+    fx_fade_init(&fx.fade, 0, BLOCKS * BLOCK, 1, 0);
+    stream_resize(&s, BLOCK, MAX(c->in, c->out));
+    for (int ch = 0; ch < MAX(c->in, c->out); ch++)
+        for (long i = 0; i < BLOCK; i++)
+            s.buffer[ch][i] = (float)rand() / RAND_MAX - 0.5f;
+
+    double start = now();
+    for (int i = 0; i < BLOCKS; i++) {
+        // the chain works in place, the samples just get quieter
+        s.channels = c->in;
+        s.frames = BLOCK;
+        if (fused) {
+            fx_chain(&fx, &s);
+            continue;
+        }
+        if (c->flags & FX_MIX)
+            fx_mix(&fx.mix, &s);
+        if (c->in != c->out)
+            fx_map(&s, c->out);
+        fx_gain(&s, fx.gain);
+        if (c->flags & FX_FADE)
+            fx_fade(&fx.fade, &s);
+        if (c->flags & FX_CLIP)
+            fx_clip(&s);
+    }
+    double seconds = now() - start;
+    stream_free(&s);
+    return seconds * 1e9 / ((double)BLOCKS * BLOCK);
+}
+
+typedef bool (*load_func)(struct decoder*, const char*);
+
+static bool native_load(struct decoder* dec, const char* path)
+{
+    return flac_load(dec, path) || wav_load(dec, path);
+}
+
+#ifdef HAVE_FFMPEG
+static bool ffmpeg_load(struct decoder* dec, const char* path)
+{
+    return ff_load(dec, path, NULL);
+}
+#endif
+
+static void bench_decode(const char* path, load_func load)
+{
+    struct decoder dec = {0};
+    struct info info = {0};
+    if (!load(&dec, path))
+        return;
+    dec.info(&dec, &info);
+    dec.free(&dec);
+
+    struct stream s = {0};
+    long frames = 0;
+    int runs = 0;
+    double start = now();
+    // loading counts too, it's part of every track change
+    while (now() - start < MIN_TIME && load(&dec, path)) {
+        do {
+            dec.decode(&dec, &s, BLOCK);
+            frames += s.frames;
+        } while (!s.end_of_stream && s.frames);
+        dec.free(&dec);
+        runs++;
+    }
+    double seconds = now() - start;
+    stream_free(&s);
+    printf("  %s: %s %d hz, %d runs, %.0fx realtime\n", path, info.codec, info.samplerate, runs,
+        (double)frames / info.samplerate / seconds);
+}
+
+int main(int argc, char** argv)
+{
+    double passes[COUNT(chain_cases)];
+    double fused[COUNT(chain_cases)];
+    for (size_t i = 0; i < COUNT(chain_cases); i++) {
+        passes[i] = time_chain(chain_cases + i, false);
+        fused[i] = time_chain(chain_cases + i, true);
+    }
+    fx_init();
+    printf("effect chain, ns per frame, %d blocks of %d frames\n", BLOCKS, BLOCK);
+    printf("  %-16s %8s %8s %8s %8s\n", "", "passes", "fused", "passes", "fused");
+    printf("  %-16s %8s %8s %8s %8s\n", "", "scalar", "scalar", "fx_init", "fx_init");
+    for (size_t i = 0; i < COUNT(chain_cases); i++) {
+        double simd_passes = time_chain(chain_cases + i, false);
+        double simd_fused = time_chain(chain_cases + i, true);
+        printf("  %-16s %8.3f %8.3f %8.3f %8.3f\n", chain_cases[i].name, passes[i], fused[i],
+            simd_passes, simd_fused);
+    }
+    if (argc > 1)
+        printf("decoding, %d frames per block\n", BLOCK);
+    for (int i = 1; i < argc; i++) {
+        bench_decode(argv[i], native_load);
+#ifdef HAVE_FFMPEG
+        bench_decode(argv[i], ffmpeg_load);
+#endif
+    }
+    return 0;
+}
@@ -0,0 +1,124 @@
+/*
+*   demosauce - fancy icecast source client
+*
+*   this source is published under the GPLv3 license.
+*   http://www.gnu.org/licenses/gpl.txt
+*   also, this is beerware! you are strongly encouraged to invite the
+*   authors of this software to a beer when you happen to meet them.
+*   copyright MMXIII by maep
+*/
+
+// runs the effect chain and sample conversion with the scalar kernels, then again with
+// whatever fx_init picks for this cpu, and compares the results
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "util.h"
+#include "effects.h"
+
+#define FRAMES      1003        // not a multiple of the vector width, so the tails run too
+#define BLOCK       301         // fade segments start and end inside blocks
+#define CONFIGS     32          // in channels, out channels, mix, clip, fade
+#define TYPES       10
+#define TOLERANCE   1e-5f       // the ramp is computed incrementally, the last bits differ
+
+static float    input[2][FRAMES];
+static float    chain_out[2][CONFIGS][2][FRAMES];
+static float    convert_out[2][TYPES][2][2][FRAMES];
+static uint8_t  raw[2 * FRAMES * sizeof (double)];
+
+// config bits: 0 mix, 1 clip, 2 fade, 3 two out channels, 4 two in channels
+static void run_chain(int config, float out[2][FRAMES])
+{
+    int in_channels = config & 16 ? 2 : 1;
+    int out_channels = config & 8 ? 2 : 1;
+    int flags = (config & 1 ? FX_MIX : 0) | (config & 2 ? FX_CLIP : 0) | (config & 4 ? FX_FADE : 0);
+    struct fx_chain fx = {{0}};
+    fx_chain_init(&fx, out_channels, 0.8f, flags);
+    fx_mix_init(&fx.mix, 0.7f, 0.3f, 0.6f, 0.4f);
+    fx_fade_init(&fx.fade, 100, 700, 1, 0.1f);
+
+    struct stream s = {0};
+    for (long pos = 0; pos < FRAMES; pos += BLOCK) {
+        int frames = MIN(BLOCK, FRAMES - pos);
+        stream_resize(&s, frames, in_channels);
+        s.channels = in_channels;
+        s.frames = frames;
+        for (int ch = 0; ch < in_channels; ch++)
+            memcpy(s.buffer[ch], input[ch] + pos, frames * sizeof (float));
+        fx_chain(&fx, &s);
+        for (int ch = 0; ch < out_channels; ch++)
+            memcpy(out[ch] + pos, s.buffer[ch], frames * sizeof (float));
+    }
+    stream_free(&s);
+}
+
+static void make_raw(int type)
+{
+    for (long i = 0; i < 2 * FRAMES; i++) {
+        float v = input[i & 1][i / 2];
+        v = CLAMP(-1.0f, v, 0.99f);
+        switch (type & ~1) {
+        case SF_INT16I:     ((int16_t*)raw)[i] = (int16_t)(v * 32767); break;
+        case SF_FLOAT32I:   ((float*)raw)[i] = v; break;
+        case SF_INT32I:     ((int32_t*)raw)[i] = (int32_t)(v * 2147483647.0); break;
+        case SF_FLOAT64I:   ((double*)raw)[i] = v; break;
+        case SF_UINT8I:     raw[i] = (uint8_t)(v * 127 + 128); break;
+        }
+    }
+}
+
+static void run_all(int pass)
+{
+    for (int config = 0; config < CONFIGS; config++)
+        run_chain(config, chain_out[pass][config]);
+    for (int type = 0; type < TYPES; type++) {
+        make_raw(type);
+        for (int channels = 1; channels <= 2; channels++) {
+            // planar data is two blocks of FRAMES samples, interleaved data one of 2 * FRAMES
+            int size = type == SF_UINT8P ? 1 : (type == SF_INT16P ? 2 : (type == SF_FLOAT64P ? 8 : 4));
+            void* in[2] = {raw, raw + FRAMES * size};
+            float* out[2] = {convert_out[pass][type][channels - 1][0], convert_out[pass][type][channels - 1][1]};
+            fx_convert_to_float(in, out, type, FRAMES, channels);
+        }
+    }
+}
+
+static bool compare(const float* a, const float* b, long frames, const char* what, int config, int ch)
+{
+    for (long i = 0; i < frames; i++) {
+        if (fabsf(a[i] - b[i]) > TOLERANCE) {
+            printf("%s %d channel %d differs at %ld: scalar %f, simd %f\n", what, config, ch, i, a[i], b[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(void)
+{
+    srand(1);
+    for (int ch = 0; ch < 2; ch++)
+        for (long i = 0; i < FRAMES; i++)
+            input[ch][i] = 3.0f * rand() / RAND_MAX - 1.5f;
+
+    run_all(0);
+    fx_init();
+    run_all(1);
+
+    bool ok = true;
+    for (int config = 0; config < CONFIGS; config++)
+        for (int ch = 0; ch < (config & 8 ? 2 : 1); ch++)
+            ok &= compare(chain_out[0][config][ch], chain_out[1][config][ch], FRAMES, "chain", config, ch);
+    for (int type = 0; type < TYPES; type++)
+        for (int channels = 1; channels <= 2; channels++)
+            for (int ch = 0; ch < channels; ch++)
+                ok &= compare(convert_out[0][type][channels - 1][ch], convert_out[1][type][channels - 1][ch],
+                    FRAMES, "convert type", type, ch);
+
+    puts(ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,228 @@
+/*
+*   demosauce - fancy icecast source client
+*
+*   this source is published under the GPLv3 license.
+*   http://www.gnu.org/licenses/gpl.txt
+*   also, this is beerware! you are strongly encouraged to invite the
+*   authors of this software to a beer when you happen to meet them.
+*   copyright MMXIII by maep
+*/
+
+// serves a generated file over http from a thread, in chunks of random size, and reads it
+// through the ffio read-ahead cache: random reads, forward seeks inside the cache, backward
+// seeks that reconnect, and the end of file
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <libavformat/avformat.h>
+#include "util.h"
+#include "ffio.h"
+
+#define FILE_SIZE   (1024 * 1024)
+#define CACHE_SIZE  (256 * 1024)
+#define MAX_READ    70000
+#define MAX_CHUNK   8192
+
+static int listen_fd = -1;
+
+static uint8_t content(long pos)
+{
+    return (uint8_t)(((uint32_t)pos * 2654435761u) >> 24);
+}
+
+static bool send_all(int fd, const void* data, long size)
+{
+    const char* p = data;
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, 0);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// answers one request, honors "Range: bytes=<start>-"
+static void* serve_connection(void* data)
+{
+    int fd = (int)(intptr_t)data;
+    char request[4096] = {0};
+    long len = 0;
+    while (!strstr(request, "\r\n\r\n")) {
+        ssize_t n = recv(fd, request + len, sizeof request - 1 - len, 0);
+        if (n <= 0 || len + n >= (long)sizeof request - 1)
+            goto done;
+        len += n;
+    }
+
+    char header[256] = {0};
+    const char* range = strstr(request, "Range: bytes=");
+    long start = range ? atol(range + 13) : 0;
+    if (start >= FILE_SIZE) {
+        snprintf(header, sizeof header, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+            "Content-Range: bytes */%d\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", FILE_SIZE);
+        send_all(fd, header, strlen(header));
+        goto done;
+    }
+    if (range)
+        snprintf(header, sizeof header, "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %ld-%d/%d\r\n"
+            "Content-Length: %ld\r\nAccept-Ranges: bytes\r\nConnection: close\r\n\r\n",
+            start, FILE_SIZE - 1, FILE_SIZE, FILE_SIZE - start);
+    else
+        snprintf(header, sizeof header, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n"
+            "Accept-Ranges: bytes\r\nConnection: close\r\n\r\n", FILE_SIZE);
+    if (!send_all(fd, header, strlen(header)))
+        goto done;
+
+    // small and uneven writes, so reads see partial data
+    unsigned seed = (unsigned)start;
+    uint8_t chunk[MAX_CHUNK];
+    for (long pos = start; pos < FILE_SIZE;) {
+        long size = 1 + rand_r(&seed) % MAX_CHUNK;
+        size = MIN(FILE_SIZE - pos, size);
+        for (long i = 0; i < size; i++)
+            chunk[i] = content(pos + i);
+        if (!send_all(fd, chunk, size))
+            break;      // the client went away, it does that when seeking
+        pos += size;
+    }
+
+done:
+    close(fd);
+    return NULL;
+}
+
+// a seek reconnects while the old connection may still be open, so each gets a thread
+static void* serve(void* data)
+{
+    int fd;
+    while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_connection, (void*)(intptr_t)fd))
+            close(fd);
+        else
+            pthread_detach(thread);
+    }
+    return NULL;
+}
+
+static int start_server(void)
+{
+    struct sockaddr_in addr = {0};
+    socklen_t addr_len = sizeof addr;
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&addr, sizeof addr) ||
+        listen(listen_fd, 8) || getsockname(listen_fd, (struct sockaddr*)&addr, &addr_len))
+        return -1;
+    return ntohs(addr.sin_port);
+}
+
+// reads <size> bytes that should start at <pos>
+static bool check_read(AVIOContext* ctx, long pos, int size)
+{
+    static uint8_t buf[MAX_READ];
+    int len = 0;
+    while (len < size) {
+        int n = avio_read(ctx, buf + len, size - len);
+        if (n <= 0) {
+            printf("read of %d bytes at %ld ended after %d (%d)\n", size, pos, len, n);
+            return false;
+        }
+        len += n;
+    }
+    for (int i = 0; i < size; i++) {
+        if (buf[i] != content(pos + i)) {
+            printf("wrong data at %ld, read of %d bytes at %ld\n", pos + i, size, pos);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool check_seek(AVIOContext* ctx, long pos)
+{
+    int64_t ret = avio_seek(ctx, pos, SEEK_SET);
+    if (ret != pos)
+        printf("seek to %ld returned %lld\n", pos, (long long)ret);
+    return ret == pos;
+}
+
+int main(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+    int port = start_server();
+    pthread_t server;
+    if (port < 0 || pthread_create(&server, NULL, serve, NULL)) {
+        puts("can't start server");
+        return 1;
+    }
+    avformat_network_init();
+    char url[64] = {0};
+    snprintf(url, sizeof url, "http://127.0.0.1:%d/test.bin", port);
+    struct ffio* io = ffio_open(url, CACHE_SIZE);
+    if (!io) {
+        printf("can't open %s\n", url);
+        return 1;
+    }
+    AVIOContext* ctx = ffio_context(io);
+    bool ok = avio_size(ctx) == FILE_SIZE;
+    if (!ok)
+        printf("size %lld, expected %d\n", (long long)avio_size(ctx), FILE_SIZE);
+
+    srand(1);
+    long pos = 0;
+    while (ok && pos < FILE_SIZE / 4) {
+        int size = 1 + rand() % MAX_READ;
+        ok = check_read(ctx, pos, size);
+        pos += size;
+    }
+
+    // give the read-ahead thread time to fill the cache, then skip ahead within it
+    util_sleep_ms(200);
+    for (int i = 0; ok && i < 3; i++) {
+        pos += 40000;
+        ok = check_seek(ctx, pos) && check_read(ctx, pos, 1000);
+        pos += 1000;
+    }
+
+    // backward seeks stop the thread and reconnect
+    for (int i = 0; ok && i < 10; i++) {
+        pos = rand() % pos;
+        int size = 1 + rand() % MAX_READ;
+        ok = check_seek(ctx, pos) && check_read(ctx, pos, size);
+        pos += size;
+    }
+
+    // the last bytes, then end of file
+    pos = FILE_SIZE - 5000;
+    if (ok && check_seek(ctx, pos) && check_read(ctx, pos, 5000)) {
+        uint8_t buf[100];
+        int n = avio_read(ctx, buf, sizeof buf);
+        if (n != AVERROR_EOF) {
+            printf("read at end of file returned %d\n", n);
+            ok = false;
+        }
+    } else {
+        ok = false;
+    }
+
+    ffio_close(io);
+    shutdown(listen_fd, SHUT_RDWR);
+    close(listen_fd);
+    pthread_join(server, NULL);
+    puts(ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,161 @@
+/*
+*   demosauce - fancy icecast source client
+*
+*   this source is published under the GPLv3 license.
+*   http://www.gnu.org/licenses/gpl.txt
+*   also, this is beerware! you are strongly encouraged to invite the
+*   authors of this software to a beer when you happen to meet them.
+*   copyright MMXIII by maep
+*/
+
+// writes a flac file with verbatim subframes and seeks across frame 64 and 128, where
+// the coded frame number grows from one to two bytes
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include "util.h"
+#include "flacdecoder.h"
+
+#define TEST_FILE   "flac_seek.flac"
+#define BLOCKSIZE   256
+#define BLOCKS      200
+#define FRAMES      (BLOCKSIZE * BLOCKS)
+
+static int16_t sample(long pos, int ch)
+{
+    return (int16_t)(((uint32_t)pos * 2654435761u + ch * 40503u) >> 16);
+}
+
+static uint8_t crc8(const uint8_t* p, int size)
+{
+    uint8_t crc = 0;
+    for (int i = 0; i < size; i++) {
+        crc ^= p[i];
+        for (int k = 0; k < 8; k++)
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+static uint16_t crc16(const uint8_t* p, int size)
+{
+    uint16_t crc = 0;
+    for (int i = 0; i < size; i++) {
+        crc ^= p[i] << 8;
+        for (int k = 0; k < 8; k++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x8005 : crc << 1;
+    }
+    return crc;
+}
+
+static bool write_file(void)
+{
+    FILE* f = fopen(TEST_FILE, "wb");
+    if (!f)
+        return false;
+    uint8_t info[42] = {'f', 'L', 'a', 'C', 0x80, 0, 0, 34};
+    uint8_t* b = info + 8;
+    b[0] = b[2] = BLOCKSIZE >> 8;
+    b[1] = b[3] = BLOCKSIZE & 0xff;
+    b[10] = 44100 >> 12;
+    b[11] = (44100 >> 4) & 0xff;
+    b[12] = (44100 & 15) << 4 | (2 - 1) << 1;     // stereo, 16 bit
+    b[13] = (16 - 1) << 4;
+    b[14] = FRAMES >> 24;
+    b[15] = (FRAMES >> 16) & 0xff;
+    b[16] = (FRAMES >> 8) & 0xff;
+    b[17] = FRAMES & 0xff;
+    fwrite(info, 1, sizeof info, f);
+
+    uint8_t frame[16 + 2 * (1 + BLOCKSIZE * 2)];
+    for (long n = 0; n < BLOCKS; n++) {
+        // fixed blocksize, 256 samples, 44.1 khz, two independent channels, 16 bit
+        int len = 0;
+        frame[len++] = 0xff;
+        frame[len++] = 0xf8;
+        frame[len++] = 0x89;
+        frame[len++] = 0x18;
+        if (n < 0x80) {
+            frame[len++] = n;
+        } else {
+            frame[len++] = 0xc0 | n >> 6;
+            frame[len++] = 0x80 | (n & 0x3f);
+        }
+        frame[len] = crc8(frame, len);
+        len++;
+        for (int ch = 0; ch < 2; ch++) {
+            frame[len++] = 0x02;        // verbatim
+            for (long i = 0; i < BLOCKSIZE; i++) {
+                uint16_t s = sample(n * BLOCKSIZE + i, ch);
+                frame[len++] = s >> 8;
+                frame[len++] = s & 0xff;
+            }
+        }
+        uint16_t crc = crc16(frame, len);
+        frame[len++] = crc >> 8;
+        frame[len++] = crc & 0xff;
+        fwrite(frame, 1, len, f);
+    }
+    return fclose(f) == 0;
+}
+
+// decodes <count> frames and compares them with what was written at <pos>
+static bool check(struct decoder* dec, struct stream* s, long pos, long count)
+{
+    long end = pos + count;
+    while (pos < end) {
+        dec->decode(dec, s, MIN(1000, end - pos));
+        if (s->frames == 0) {
+            printf("stream ended at %ld, expected %ld\n", pos, end);
+            return false;
+        }
+        for (long i = 0; i < s->frames; i++) {
+            for (int ch = 0; ch < 2; ch++) {
+                float expected = sample(pos + i, ch) / 32768.0f;
+                if (fabsf(s->buffer[ch][i] - expected) > 1e-6f) {
+                    printf("mismatch at %ld channel %d: %f, expected %f\n", pos + i, ch,
+                        s->buffer[ch][i], expected);
+                    return false;
+                }
+            }
+        }
+        pos += s->frames;
+    }
+    return true;
+}
+
+int main(void)
+{
+    if (!write_file()) {
+        puts("can't write " TEST_FILE);
+        return 1;
+    }
+    struct decoder dec = {0};
+    if (!flac_load(&dec, TEST_FILE)) {
+        puts("can't load " TEST_FILE);
+        return 1;
+    }
+    struct stream s = {0};
+    bool ok = check(&dec, &s, 0, FRAMES);
+
+    static const long positions[] = {
+        63 * BLOCKSIZE, 64 * BLOCKSIZE, 64 * BLOCKSIZE + 17, 100 * BLOCKSIZE + 5,
+        127 * BLOCKSIZE + 255, 128 * BLOCKSIZE, 150 * BLOCKSIZE + 99, 10 * BLOCKSIZE + 3,
+        FRAMES - 300
+    };
+    for (size_t i = 0; i < COUNT(positions); i++) {
+        dec.seek(&dec, positions[i]);
+        if (!check(&dec, &s, positions[i], 300)) {
+            printf("seek to %ld failed\n", positions[i]);
+            ok = false;
+        }
+    }
+
+    stream_free(&s);
+    dec.free(&dec);
+    remove(TEST_FILE);
+    puts(ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}